@@ -0,0 +1,45 @@
+/*
+	click_bench.cpp - A microbenchmark of the channel protocol
+	It clicks random grids (without skipping) on a single channel, and reports
+	the average time and the number of futex syscalls issued by the player's
+	program per click (see `ChannelStats`). The game server reports its side
+	when launched with MINESWEEPER_GS_STATS=1.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+// 请在程序开头引用此头文件
+#include "minesweeper_helpers.h"
+
+// The number of clicks
+constexpr long NUM_CLICKS = 200000;
+
+long N, K;
+int constant_A;
+
+int main() {
+	minesweeper_init(N, K, constant_A);
+	Channel channel = create_channel();
+
+	srand(2023);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < NUM_CLICKS; ++i) {
+		ClickResult result = channel.click(rand()%N, rand()%N, false);
+		while (result.has_more) {
+			channel.next_chunk(result);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double ns = (end.tv_sec-start.tv_sec)*1e9 + (end.tv_nsec-start.tv_nsec);
+	ChannelStats stats = channel.stats();
+	fprintf(stderr, "click_bench: N = %ld, %ld clicks, %.2f us/click, "
+		"%.4f futex_wake/click, %.4f futex_wait/click (%ld spin waits, %ld futex waits)\n",
+		N, NUM_CLICKS, ns/NUM_CLICKS/1e3,
+		(double)stats.num_futex_wakes/NUM_CLICKS, (double)stats.num_futex_waits/NUM_CLICKS,
+		stats.num_spin_waits, stats.num_futex_waits);
+	return 0;
+}
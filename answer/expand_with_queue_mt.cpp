@@ -111,6 +111,33 @@ bool click_and_put_result_no_expand(Channel &channel, int r, int c, long &local_
 	return result.is_mine;
 }
 
+// 和 click_and_put_result_no_expand 一样，不过一次性点开 requests 中的 n 个格子
+// (所有点击都必须带有 CLICK_FLAG_DO_NOT_EXPAND)。返回点到的雷的数量
+int click_batch_and_put_result_no_expand(Channel &channel, ClickRequest* requests, int n, long &local_cnt_empty_opened) {
+	ClickResult results[MAX_CLICK_BATCH_SIZE];
+	int cnt_mine = 0;
+	while (n) {
+		int num_served = channel.click_batch(requests, n, results);
+		for (int i = 0; i < num_served; ++i) {
+			int r = requests[i].r, c = requests[i].c;
+			if (results[i].is_mine) {
+				map[r][c] = MAP_MINE;
+				cnt_mine += 1;
+			} else if (map[r][c] == MAP_UNKNOWN) {
+				local_cnt_empty_opened++;
+				if (local_cnt_empty_opened == APPROX_COUNTING_THRES) {
+					cnt_empty_opened += APPROX_COUNTING_THRES;
+					local_cnt_empty_opened = 0;
+				}
+				map[r][c] = (*results[i].open_grid_pos)[0][2];
+			}
+		}
+		requests += num_served;
+		n -= num_served;
+	}
+	return cnt_mine;
+}
+
 
 // 原则：每个数字格子最多被一个线程入队
 // 所以我们用 marker 记录第一个点开这个格子的线程的 TID
@@ -147,6 +174,9 @@ void expand(int start_r, int start_c, int thread_id, Channel &channel, long &loc
 		int adj_mine = count_adj_mine(cur_r, cur_c);
 		if (adj_mine == num_in_grid) {
 			// 所有未知的格子都是安全的
+			// 把它们攒起来，用一次 click_batch 全部点开
+			ClickRequest requests[8];
+			int num_requests = 0;
 			for (int k = 0; k < 8; ++k) {
 				int new_r = cur_r + delta_xy[k][0];
 				int new_c = cur_c + delta_xy[k][1];
@@ -154,9 +184,14 @@ void expand(int start_r, int start_c, int thread_id, Channel &channel, long &loc
 				if (map[new_r][new_c] != MAP_UNKNOWN) continue;
 				if (marker[new_r][new_c] != 0 && marker[new_r][new_c] != thread_id) continue;
 				marker[new_r][new_c] = thread_id;
-				bool is_mine = click_and_put_result_no_expand(channel, new_r, new_c, local_cnt_empty_opened);
-				assert(!is_mine);
-				border.push_front({new_r, new_c, 0});
+				requests[num_requests++] = {(unsigned short)new_r, (unsigned short)new_c, CLICK_FLAG_DO_NOT_EXPAND};
+			}
+			if (num_requests) {
+				int cnt_mine __attribute__((unused)) = click_batch_and_put_result_no_expand(channel, requests, num_requests, local_cnt_empty_opened);
+				assert(cnt_mine == 0);
+				for (int i = 0; i < num_requests; ++i) {
+					border.push_front({requests[i].r, requests[i].c, 0});
+				}
 			}
 		} else if (adj_unknown+adj_mine == num_in_grid) {
 			// 所有未知的格子都是雷
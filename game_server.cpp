@@ -6,23 +6,86 @@
 
 		It accepts the following envariables: MINESWEEPER_LAUNCHED_BY_JUDGER (must present),
 	MINESWEEPER_MAP_FILE_PATH, MINESWEEPER_FD_GS_TO_PL, MINESWEEPER_FD_GS_FROM_PL,
-	MINESWEEPER_FD_GS_TO_JU, MINESWEEPER_FD_GS_FROM_JU.
+	MINESWEEPER_FD_GS_TO_JU, MINESWEEPER_FD_GS_FROM_JU, and optionally
+	MINESWEEPER_CORE_PAIRS (see `affinity.h`).
 		It first parses those envariables and reads the map from the file
 	indicated by MINESWEEPER_MAP_FILE_PATH. Then it begins to interact with
 	the player's program.
 		When the player's program sents an 'C' (stands for "Create Channel"),
 	the game server creates a new channel and responses with the channel ID.
+	An 'A' creates an asynchronous channel in the same way (see below). An 'M'
+	followed by an int n (in binary) creates n channels at once, and the game
+	server responses with their IDs (n ints in binary).
 		When the player's program exits or the time is up, the judger sents an 'F'
 	(stands for "Finished") character to the game server (received through
 	`fd_from_ju`), and then the game server will send the number of opened
 	non-mine grids and opened is-mine grids to the judger (sent through
 	`fd_to_ju`)
 
+	Optional envariables (for tuning the game server on different hosts):
+		- MINESWEEPER_GS_ADJ_MINE_TABLE (default: 1). If it is 1, the game server
+		precomputes the number in every grid when loading the map (see
+		`build_adj_mine_table()`), which costs N*N/2 bytes of memory (128 MB
+		when N = 16384, 512 MB when N = 32768). Set it to 0 on memory-constrained
+		hosts, then the number is computed on the fly.
+		- MINESWEEPER_GS_ADJ_MINE_TABLE_MAX_N (default: 32768). The adjacent mine
+		table is only built when 8 <= N <= this value, so that it does not take
+		2 GB for a 65536x65536 map by surprise. Raise it to 65536 on hosts with
+		enough memory.
+		- MINESWEEPER_GS_ZERO_COMPONENTS (default: 0). If it is 1, the game server
+		labels all connected components of zero grids when loading the map, and
+		a `click()` on a zero grid copies a precomputed list instead of doing
+		a BFS. It costs about N*N*9 bytes, and is only supported when N <= 32768.
+		- MINESWEEPER_GS_BITWISE_BFS (default: 1). If it is 1, the game server
+		expands zero grids with a bit-parallel flood fill instead of a BFS (see
+		"Bit-parallel flood fill" below), which costs N*N/8 bytes of memory.
+		- MINESWEEPER_GS_VERIFY_FLOOD (default: 0). If it is 1, before the game
+		starts, the game server expands every zero component with both the
+		flood fill and the BFS, and compares the results (see "Checking the
+		flood fill" below). It takes a while on large maps.
+		- MINESWEEPER_GS_VERIFY_SUMMARY (default: 0). If it is 1, when summarizing,
+		the game server scans the whole map to verify the counters of opened
+		grids, and reports the result of the scan.
+		- MINESWEEPER_GS_BOARD_LAYOUT (default: row). The way `is_mine` and
+		`is_open` are stored, "row" (row-major bit arrays) or "tiled" (8x8 tiles
+		in Morton order, see "Board layout" below).
+		- MINESWEEPER_GS_POOL_THREADS (default: 0). If it is positive, channels
+		(except asynchronous ones) are served by a pool of this many threads
+		instead of a thread per channel (see "Thread pool" below), so the
+		player's program can have many channels without oversubscribing the CPU.
+		- MINESWEEPER_GS_PARKED_CHUNKS (default: 64). With the thread pool, the
+		number of chunks of a reply a thread keeps for a channel instead of
+		waiting for the player's program to take them (see "Parked replies"
+		below). Each takes MAX_OPEN_GRID*6 bytes.
+		- MINESWEEPER_GS_PRESPAWN_WORKERS (default: 0). The number of idle worker
+		threads spawned before the game starts (see "Spawning worker threads"
+		below), so that creating channels does not wait for thread creation.
+		- MINESWEEPER_GS_DAEMON_SOCKET (default: none). If it is set, the game
+		server is started by hand instead of by the judger, and hosts judging
+		sessions on one map, which are handed over by judgers through a unix
+		socket at this path (see "Daemon mode" below).
+		- MINESWEEPER_GS_HUGE_PAGES (default: 0). If it is 1 (or 2), the large
+		bit arrays and tables (`is_open`, `board`, `adj_mine_table`, `zero_mask`,
+		`zero_comp_id`) are backed by transparent huge pages (or the hugetlb
+		pool), prefaulted and locked if allowed, and the map file and the shm
+		region are advised to use huge pages, too (see lib/plane.h).
+		- MINESWEEPER_GS_OPEN_BITMAP (default: 0). If it is 1, the shared open
+		bitmap (N*N/8 bytes of /dev/shm) is created at start-up, instead of on
+		the first `click(r, c, true)` of the player's program (see "Shared open
+		bitmap" below).
+		- MINESWEEPER_GS_STATS (default: 0). If it is 1, worker threads collect
+		statistics (e.g. the throughput of BFS, spin hits of the two-phase lock),
+		which are logged when summarizing.
+
 	Overall Design:
 		The main thread is responsible for listening to `fd_from_ju` and `fd_from_pl`
 	at the same time (by I/O multiplexing). When the judger sents an 'F', the
 	game server responses with the result (see above). When the player's program
-	sents an 'C', it creates a new thread and let that thread handle that Channel.
+	sents an 'C', it initializes a new channel and hands it over to a worker
+	thread (see "Spawning worker threads"). When it sends an 'R', the game
+	server publishes the grids opened so far in the shm object, and keeps them
+	up to date from then on (see "Revealed board"). A 'B' does the same for the
+	opened non-mine grids (see "Shared open bitmap").
 		Each channel has a unique shared memory region. The player's program
 	uses that region to communicate with the game server. (Note. we use shared
 	memory instead of pipe/FIFO/message-queue to avoid overhead introduced by
@@ -30,8 +93,9 @@
 		Each channel is handled by a particular thread, which we called "worker
 	thread". The worker thread monitors the channel (namely, monitors the shared
 	memory region). The worker thread acts like a "two-phase lock". After creation
-	or completing a `click` request, the worker thread first spins for a certain
-	times. If it did not detect further requests, it calls `futex_wait` and
+	or completing a `click` request, the worker thread first spins for a while
+	(how long depends on how busy the channel has been, see "Adaptive two phase
+	lock"). If it did not detect further requests, it calls `futex_wait` and
 	begins to sleep, until a new request arrives. We use this mechanism to ensure:
 		- If the channel is busy (i.e. the player's program uses the channel
 		frequently), then the worker thread just spins in the interval between
@@ -45,15 +109,12 @@
 	Memory layout of a channel:
 		Each channel has a shared memory (shm) region of `CHANNEL_SHM_SIZE` bytes,
 	where `CHANNEL_SHM_SIZE` is defined in `common.h`. 
-		Memory layout:
-		- 4 byte: `pending bit`. When the player's program wants to click, it sets this
-			bit to 1 first.
-		- 4 byte: `sleeping bit`. When the game server is about to enter the second phase
-			(futex_wait), it sets this bit to 1. When the player's program wants to click,
-			it tests whether this bit is 1. If it is 1 then the player's program will
-			call `futex_wake()`.
-		- 4 byte: `done bit`. When the game server completes the request, it
-			sets this bit to 1.
+		Memory layout (version SHM_LAYOUT_VERSION_CURRENT, see `shm.h` for offsets):
+		- 4 bytes: the version of the layout, in a cache line of its own. The
+			player's program checks it when creating a channel.
+		The request line (64 bytes, only written by the player's program):
+		- 4 bytes `request sequence number`. The player's program fills in the
+			fields below, then increases it by 1 to submit a request.
 		- 4 bytes `skip_when_reopen bit`. If it is 1 and the target grid of the
 			current request has been opened before, then the game server will
 			put -2 （or -3, if the grid contains a mine） in "bytes indicating
@@ -63,46 +124,128 @@
 			'0'". In other words, "间接点开" will not be proceed.
 		- 2 bytes for click_r
 		- 2 bytes for click_c
+		- 4 bytes `batch size`. 0 for a single click. Otherwise the request is
+			a batch of clicks (see `Channel::click_batch()`), and the fields
+			above (click_r, click_c and the bits) are ignored.
+		- 4 bytes `client waiting bit`. The player's program spins for a while
+			after submitting a request, and then sets this bit to 1 and sleeps
+			on the done sequence number with `futex_wait`. The game server calls
+			`futex_wake()` after completing a request only if this bit is 1.
+		- 4 bytes `close state`. If it is SHM_CLOSE_REQUESTED, the request closes
+			the channel (see `Channel::close()`), and the other fields are ignored.
+			The player's program sets it to SHM_CLOSE_LEFT when it leaves the
+			closed channel.
+		- 4 bytes `new_only bit`. If it is 1 and the target grid contains 0,
+			only the grids opened for the first time by this request are put
+			into the result (see "Delta-only replies"). The expansion itself is
+			the same.
+		- 4 bytes `runs bit`. If it is 1, the opened grids are put into runs
+			(see "Run-length replies" in `shm.h`) instead of the entries below.
+		- 4 bytes `rect height` and 4 bytes `rect width`. If the height is not
+			0, the request opens the rectangle at (click_r, click_c) without
+			expansion, and the reply is a tile of 4-bit codes (see "Rectangle
+			requests"). The bits above are ignored.
+		The completion line (64 bytes, only written by the game server):
+		- 4 bytes `done sequence number`. When the game server completes the
+			request, it sets this to the request sequence number.
 		- 4 bytes indicating how many grids are opened (-1 if the grid contains a mine,
 			-2 if `re_report bit` is 0 and the target grid of the current request
-			has been opened before)
+			has been opened before). For a batched request, it is the number of
+			requests served by the game server.
+		- 4 byte: `sleeping bit`. When the game server is about to enter the second phase
+			(futex_wait on the request sequence number), it sets this bit to 1.
+			After submitting a request, the player's program tests whether this bit
+			is 1. If it is 1 then the player's program will call `futex_wake()`.
+		Then, starting from the 5th cache line:
 		- 2 bytes r1, 2 bytes c1, 2 bytes number in grid (r1, c1)
 		- 2 bytes r2, 2 bytes c2, 2 bytes number in grid (r2, c2)
 		- ...
 		- 2 bytes rK, 2 bytes cK, 2 bytes number in grid (rK, cK)
+		(The following fields start right after the room for MAX_OPEN_GRID grids
+		above, and are only used by batched requests)
+		- MAX_BATCH_SIZE requests, each of which has 2 bytes r, 2 bytes c and 2
+			bytes flags (SHM_CLICK_FLAG_SKIP_WHEN_REOPEN, SHM_CLICK_FLAG_DO_NOT_EXPAND,
+			SHM_CLICK_FLAG_NEW_ONLY, SHM_CLICK_FLAG_RUNS)
+		- MAX_BATCH_SIZE results, each of which has 4 bytes "how many grids are
+			opened" (same as above) and 4 bytes offset, the index of the first
+			grid of this request among those opened grids
+		(Counters for streaming results of more than MAX_OPEN_GRID grids in
+		chunks live in the request line and the completion line as well, see
+		"Streaming of large results" in `shm.h`)
+
+	Asynchronous channels:
+		The protocol above allows only one outstanding request per channel. An
+	asynchronous channel has a different layout (see `shm.h`): the player's
+	program puts requests into a single-producer submission ring, and the
+	worker thread serves them one by one and puts the results into a
+	completion ring, so the player's program can keep several clicks in
+	flight. The worker thread sleeps on the tail of the submission ring with
+	the same "two-phase lock".
 */
+#include <algorithm>
 #include <atomic>
 #include <utility>
 #include <vector>
 #include <climits>
-#include <functional>
 #include "lib/wrappers.h"
 #include "lib/log.h"
 #include "lib/common.h"
 #include "lib/shm.h"
 #include "lib/futex.h"
 #include "lib/queue.h"
+#include "lib/visited_set.h"
+#include "lib/word_map.h"
+#include "lib/affinity.h"
+#include "lib/session.h"
+#include "lib/plane.h"
 using std::atomic_flag, std::atomic, std::atomic_compare_exchange_strong;
 using std::pair, std::vector;
-using std::max, std::min;
+using std::max, std::min, std::sort, std::swap;
 
 void kill_worker_threads();
+void join_worker_threads();
 void report_error_to_judger(const char* error_s);
 
-// The upper limit for active (doing BFS) worker threads
-// We need this because that every worker thread which is doing BFS needs a
-// vis[] array. If we allocate a unique vis[] array for each thread, then
-// the memory usage would be unacceptable. Instead, we just allocate a vis[]
-// array with NUM_ACTIVE_WORKER_THREAD*N*N bits, and when a thread wants
-// to BFS, it just use N*N bits from the array.
-constexpr int NUM_ACTIVE_WORKER_THREAD = 8;
-
 // The number of thread for `summarize()`
 constexpr int NUM_SUMMARIZE_THREAD = 8;	
 
-// The spin amount in the two phase lock.
+// Whether `summarize()` should verify the counters by scanning the whole map
+bool verify_summary = false;
+
+// Whether to check the flood fill against the BFS at start-up (see "Checking
+// the flood fill")
+bool verify_flood = false;
+
+// Whether worker threads should collect statistics (see `WorkerStats`)
+bool collect_stats = false;
+
+// The number of threads in the pool (see "Thread pool"). 0 means that every
+// channel has its own worker thread
+int num_pool_threads = 0;
+
+// The number of chunks a thread in the pool keeps for a channel (see "Parked
+// replies")
+long parked_max_chunks = 64;
+
+// The number of idle worker threads spawned before the game starts (see
+// "Spawning worker threads")
+int num_prespawn_workers = 0;
+
+// Core pairs handed out by the judger (see `affinity.h`). The worker thread
+// of a channel is bound to the partner core of the player's thread which
+// creates it. Threads in the pool are not bound, since they serve channels of
+// all player's threads
+CorePair core_pairs[MAX_CORE_PAIRS];
+int num_core_pairs;
+
+// The spin amount when waiting for the player's program to consume a chunk
+// (see `wait_for_chunk_ack()`). Waiting for requests uses an adaptive spin
+// budget instead, see "Adaptive two phase lock"
 constexpr int TWO_PHASE_LOCK_SPIN_AMUONT = 2048;
 
+// The number of thread for preprocessing the map (e.g. `build_adj_mine_table()`)
+constexpr int NUM_PREPROCESS_THREAD = 16;
+
 long N, K, logN;	// The size of the map, the number of mines
 char* map_file_path;	// path to the map file
 int fd_to_pl, fd_from_pl;	// fds (used to communicate with player's program)
@@ -110,78 +253,829 @@ int fd_to_ju, fd_from_ju;	// fds (used to communicate with the judger)
 
 char* shm_name;
 char* shm_start;	// Point to the head of the shared memory region
+HugePageMode huge_page_mode = HUGE_PAGES_OFF;	// How large arrays are backed, see lib/plane.h
+
+// The path of the socket to listen on in the daemon mode (see "Daemon mode"),
+// or NULL if the game server is launched by the judger for a single session
+char* daemon_socket_path;
+
+char* map_file_start;	// The map file, mapped into the memory (read only)
+long map_file_size;
+const char* is_mine;	// A large bit array, representing the map. Points into the mapped map file
+
+/*
+ * Board layout
+ *	By default (BOARD_LAYOUT_ROW), `is_mine` and `is_open` are row-major bit
+ * arrays, so the three rows of a 3x3 neighbourhood are N/8 bytes away from
+ * each other, and the two arrays are far away from each other as well.
+ *	In BOARD_LAYOUT_TILED, the map is split into 8x8 tiles. A tile is stored in
+ * a 64-bit word (the grid (r, c) is the ((r%8)*8 + c%8)-th bit), and the
+ * tiles are ordered by Morton order (Z-order) of (r/8, c/8), so nearby tiles
+ * are usually nearby in memory. The mine word and the open word of a tile
+ * are next to each other: `board[2*t]` and `board[2*t+1]`. `is_open` is not
+ * allocated in this layout, while `is_mine` still points to the map file (it
+ * is used when loading the map).
+ */
+enum BoardLayout {BOARD_LAYOUT_ROW, BOARD_LAYOUT_TILED};
+BoardLayout board_layout = BOARD_LAYOUT_ROW;
+uint64_t* board;	// Only available in BOARD_LAYOUT_TILED
+
+// board_size - The size of `board` in bytes
+inline long board_size() {
+	return (N/8)*(N/8)*2*sizeof(uint64_t);
+}
+
+// spread_bits - Insert a 0 bit before every bit of x (x < 2^32)
+inline uint64_t spread_bits(uint64_t x) {
+	x = (x | x<<16) & 0x0000ffff0000ffffUL;
+	x = (x | x<<8) & 0x00ff00ff00ff00ffUL;
+	x = (x | x<<4) & 0x0f0f0f0f0f0f0f0fUL;
+	x = (x | x<<2) & 0x3333333333333333UL;
+	x = (x | x<<1) & 0x5555555555555555UL;
+	return x;
+}
+// The index of the tile containing (r, c)
+inline long tile_index(long r, long c) {
+	return spread_bits(r>>3)<<1 | spread_bits(c>>3);
+}
+// The bit of (r, c) in the word of its tile
+inline long tile_offset(long r, long c) {
+	return (r&7)<<3 | (c&7);
+}
 
-char* is_mine;	// A large bit array, representing the map.
 inline char test_is_mine(long r, long c) {
 	if (r < 0 || c < 0 || r >= N || c >= N) return 0;
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		return board[tile_index(r, c)*2]>>tile_offset(r, c)&0x1;
+	}
 	long index = (r<<logN) + c;
 	long number = index/8, offset = index%8;
 	return is_mine[number]>>offset&0x1;
 }
-inline char get_adj_mine(long r, long c) {
+inline char count_adj_mine(long r, long c) {
 	return test_is_mine(r-1, c-1) + test_is_mine(r-1, c) + test_is_mine(r-1, c+1)
 		+  test_is_mine(r, c-1) + test_is_mine(r, c+1)
 		+  test_is_mine(r+1, c-1) + test_is_mine(r+1, c) + test_is_mine(r+1, c+1);
 }
 
+// The "adjacent mine table". It stores the number in every grid, 4 bits per grid
+// (the grid with index i lives in the (i%2*4)-th ~ (i%2*4+3)-th bits of
+// adj_mine_table[i/2]). It is only available when `use_adj_mine_table` is true
+bool use_adj_mine_table = true;
+// The table takes N*N/2 bytes, so it is disabled for maps larger than this
+// (it would take 2 GB when N = 65536). Set by MINESWEEPER_GS_ADJ_MINE_TABLE_MAX_N
+long max_n_for_adj_mine_table = 32768;
+char* adj_mine_table;
+inline char get_adj_mine(long r, long c) {
+	if (use_adj_mine_table) {
+		long index = (r<<logN) + c;
+		return adj_mine_table[index/2]>>(index%2*4)&0xf;
+	}
+	return count_adj_mine(r, c);
+}
+
+// Counters of opened grids. A grid is counted when its bit in `is_open` turns
+// from 0 to 1, by the counter of the worker thread which opens it, so
+// `summarize()` doesn't need to scan the whole map. Each counter takes a
+// whole cache line to avoid false sharing
+struct alignas(64) OpenCounter {
+	long cnt_non_mine;
+	long cnt_is_mine;
+};
+OpenCounter open_counters[MAX_CHANNEL];
+thread_local OpenCounter* my_open_counter;	// Set when the worker thread starts
+
+// Statistics of a worker thread, collected only when `collect_stats` is true,
+// and logged by `summarize()`. They are for benchmarking the game server
+struct alignas(64) WorkerStats {
+	long num_bfs;		// The number of BFS
+	long num_bfs_grids;	// The number of grids returned by those BFS
+	long bfs_ns;		// Time spent on those BFS, in nanoseconds
+	long num_spin_hits;	// Requests caught while spinning (see `two_phase_wait()`)
+	long num_futex_sleeps;	// Requests waited for with `futex_wait`
+	long num_pure_spin_waits;	// Waits in the pure spin mode
+	long num_client_wakes;	// `futex_wake` calls for sleeping player's threads
+};
+WorkerStats worker_stats[MAX_CHANNEL];
+thread_local WorkerStats* my_worker_stats;	// Set when the worker thread starts
+
+// get_time_ns - Read the monotonic clock, in nanoseconds
+inline long get_time_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Shared open bitmap
+ *	`click(r, c, true)` on a grid opened before only returns "skipped", but it
+ * still costs a round trip through the channel. So the game server also keeps
+ * a row-major bitmap of the opened non-mine grids in the shm object (see
+ * "Planes after the channels" in `shm.h`), which the player's program maps
+ * read-only and checks before sending such a request. Bits are set (with
+ * release semantics) by `set_is_open()` / `set_is_open_word()` when grids
+ * are newly opened, i.e. at most once per grid, in both board layouts.
+ * Opened mines are left out: they are rare, and the player's program would
+ * need to know that the grid is a mine to answer for it.
+ *	The bitmap takes N*N/8 bytes of /dev/shm, so it is only created on a 'B'
+ * from the player's program, whose helpers send it on the first such click,
+ * or at start-up with MINESWEEPER_GS_OPEN_BITMAP. It is enabled while worker
+ * threads are opening grids, which works like "Revealed board" below. If it
+ * cannot be created, the player's program sends such clicks to the game
+ * server as before.
+ */
+unsigned char* shared_open_bitmap;	// NULL until it is enabled
+bool eager_open_bitmap = false;
+
+/*
+ * Revealed board
+ *	On an 'R' from the player's program, the game server publishes what has
+ * been opened as a read-only plane of 4-bit codes in the shm object (see
+ * "Planes after the channels" in `shm.h`), so that the threads of the player's program
+ * can share it instead of each keeping their own copy of the board. From then
+ * on, every grid newly opened by `set_is_open()` / `set_is_open_word()` gets
+ * its code before the reply of the click is published.
+ *	The plane is enabled while worker threads are opening grids. A worker
+ * opens a grid (an atomic RMW on `is_open`) and then loads `revealed_plane`,
+ * while the main thread stores `revealed_plane` and then scans `is_open` for
+ * the grids opened earlier. Both sides are sequentially consistent, so every
+ * opened grid is written by at least one of them. Codes are written with an
+ * atomic OR (two grids share a byte), so writing one twice does no harm.
+ */
+unsigned char* revealed_plane;	// NULL until the player's program asks for it
+
+// publish_revealed - Write the code of the opened grid (r, c) into `plane`
+inline void publish_revealed(unsigned char* plane, long r, long c) {
+	long index = (r<<logN) + c;
+	unsigned char code = test_is_mine(r, c) ? REVEALED_CODE_MINE : REVEALED_CODE_NUMBER(get_adj_mine(r, c));
+	__atomic_fetch_or(plane + index/2, code<<(index%2*4), __ATOMIC_RELAXED);
+}
+
+// publish_revealed_word - Write the codes of the opened non-mine grids
+// (r, wc*64+i) for every set bit i in `bits` into `plane`, 16 grids per OR
+inline void publish_revealed_word(unsigned char* plane, long r, long wc, uint64_t bits) {
+	uint64_t* words = (uint64_t*)(plane + ((r<<logN) + wc*64)/2);
+	for (int k = 0; k < 4; ++k) {
+		uint64_t group = bits>>(k*16)&0xffff, codes = 0;
+		while (group) {
+			int i = __builtin_ctzl(group);
+			codes |= (uint64_t)REVEALED_CODE_NUMBER(get_adj_mine(r, wc*64 + k*16 + i))<<(i*4);
+			group &= group-1;
+		}
+		if (codes) {
+			__atomic_fetch_or(words+k, codes, __ATOMIC_RELAXED);
+		}
+	}
+}
+
 char* is_open;	// A large bit array, representing whether the grid is opened by the player
 inline char test_is_open(long r, long c) {
 	if (r < 0 || c < 0 || r >= N || c >= N) return 0;
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		return __atomic_load_n(board + tile_index(r, c)*2+1, __ATOMIC_RELAXED)>>tile_offset(r, c)&0x1;
+	}
 	long index = (r<<logN) + c;
 	long number = index/8, offset = index%8;
 	return is_open[number]>>offset&0x1;
 }
-inline void set_is_open(long r, long c) {
-	long index = (r<<logN) + c;
-	long number = index/8, offset = index%8;
-	__atomic_or_fetch(is_open+number, 0x1<<offset, __ATOMIC_RELAXED);
-	// is_open[number] |= 0x1<<offset;	// Data race
+// set_is_open - Open the grid (r, c). Return whether it is opened for the
+// first time
+inline bool set_is_open(long r, long c) {
+	bool newly_opened;
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		long offset = tile_offset(r, c);
+		uint64_t old = __atomic_fetch_or(board + tile_index(r, c)*2+1, 1UL<<offset, __ATOMIC_SEQ_CST);
+		newly_opened = !(old>>offset&0x1);
+	} else {
+		long index = (r<<logN) + c;
+		long number = index/8, offset = index%8;
+		char old = __atomic_fetch_or(is_open+number, 0x1<<offset, __ATOMIC_SEQ_CST);
+		// is_open[number] |= 0x1<<offset;	// Data race
+		newly_opened = !(old>>offset&0x1);
+	}
+	if (newly_opened) {
+		if (test_is_mine(r, c)) {
+			my_open_counter->cnt_is_mine += 1;
+		} else {
+			my_open_counter->cnt_non_mine += 1;
+			unsigned char* bitmap = __atomic_load_n(&shared_open_bitmap, __ATOMIC_SEQ_CST);
+			if (bitmap) {
+				long index = (r<<logN) + c;
+				__atomic_fetch_or(bitmap + index/8, 0x1<<(index%8), __ATOMIC_RELEASE);
+			}
+		}
+		// SEQ_CST (see "Revealed board"). On x86 the RMW above is a locked
+		// instruction anyway, so it costs nothing
+		unsigned char* plane = __atomic_load_n(&revealed_plane, __ATOMIC_SEQ_CST);
+		if (plane) {
+			publish_revealed(plane, r, c);
+		}
+	}
+	return newly_opened;
+}
+// set_is_open_word - Open the grids (r, wc*64+i) for every set bit i in
+// `bits`. All of them must be non-mine grids. Return the bits of the grids
+// opened for the first time
+inline uint64_t set_is_open_word(long r, long wc, uint64_t bits) {
+	uint64_t newly_opened;
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		// The word covers one row of 8 tiles
+		newly_opened = 0;
+		for (long i = 0; i < 8; ++i) {
+			uint64_t byte = bits>>(i*8)&0xff;
+			if (!byte) continue;
+			long offset = (r&7)*8;
+			uint64_t old = __atomic_fetch_or(board + tile_index(r, wc*64+i*8)*2+1, byte<<offset, __ATOMIC_SEQ_CST);
+			newly_opened |= (byte & ~(old>>offset))<<(i*8);
+		}
+	} else {
+		uint64_t* word = (uint64_t*)(is_open + (r<<logN)/8) + wc;
+		newly_opened = bits & ~__atomic_fetch_or(word, bits, __ATOMIC_SEQ_CST);
+	}
+	my_open_counter->cnt_non_mine += __builtin_popcountl(newly_opened);
+	if (newly_opened) {
+		unsigned char* bitmap = __atomic_load_n(&shared_open_bitmap, __ATOMIC_SEQ_CST);
+		if (bitmap) {
+			uint64_t* shared_word = (uint64_t*)(bitmap + (r<<logN)/8) + wc;
+			__atomic_fetch_or(shared_word, newly_opened, __ATOMIC_RELEASE);
+		}
+		unsigned char* plane = __atomic_load_n(&revealed_plane, __ATOMIC_SEQ_CST);
+		if (plane) {
+			publish_revealed_word(plane, r, wc, newly_opened);
+		}
+	}
+	return newly_opened;
+}
+
+// load_open_word - The bits of `is_open` of the grids (r, wc*64+i), for
+// i = 0 ~ 63. It needs N >= 64
+inline uint64_t load_open_word(long r, long wc) {
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		// The word covers one row of 8 tiles
+		uint64_t word = 0;
+		for (long i = 0; i < 8; ++i) {
+			uint64_t open = __atomic_load_n(board + tile_index(r, wc*64+i*8)*2+1, __ATOMIC_RELAXED);
+			word |= (open>>((r&7)*8)&0xff)<<(i*8);
+		}
+		return word;
+	}
+	return __atomic_load_n((uint64_t*)(is_open + (r<<logN)/8) + wc, __ATOMIC_RELAXED);
 }
 
+/*
+ * Zero components
+ *	A "zero component" is a connected component of grids containing 0 (8
+ * neighbours). Clicking any grid in it opens the whole component and its
+ * border, so if `use_zero_comps` is true, we precompute all of them when
+ * loading the map, and a `click()` on a zero grid becomes a memcpy of the
+ * precomputed list of grids instead of a BFS.
+ *	Components are labelled by a union-find over row bands: each thread labels
+ * the rows of its band, then the main thread merges the components across
+ * band boundaries. The parent of a grid is stored in `zero_comp_id` itself.
+ */
+
+// zero_comp_id is 4 bytes per grid, so we only support N <= 32768 (16 GB
+// would be needed for N = 65536)
+constexpr long MAX_N_FOR_ZERO_COMPS = 32768;
+bool use_zero_comps = false;
+
+// For a zero grid with index i, zero_comp_id[i] is the ID of its component
+// plus 1. For other grids, it is 0
+unsigned int* zero_comp_id;
+long num_zero_comps;
+// Grids (r, c, number) in (or on the border of) the i-th component are
+// zero_comp_grids[zero_comp_start[i] ~ zero_comp_start[i+1]-1]
+long* zero_comp_start;
+unsigned short (*zero_comp_grids)[3];
+
+/*
+ * Bit-parallel flood fill
+ *	If `use_bitwise_bfs` is true, a `click()` on a zero grid (that is not
+ * served by zero components) is served by `worker_thread_flood()` instead of
+ * the BFS. It works on 64-bit words of rows: `zero_mask` is a row-major bit
+ * array of zero grids, and the region is grown a whole word at a time with
+ * shifts and ANDs until a fixed point is reached. The opened grids are then
+ * extracted with `__builtin_ctzl`, and `is_open` is updated a word at a time.
+ * It needs N >= 64, and costs N*N/8 bytes of memory for `zero_mask`.
+ */
+bool use_bitwise_bfs = true;
+uint64_t* zero_mask;	// The bit of (r, c) is the (c%64)-th bit of zero_mask[(r<<logN)/64 + c/64]
+long logW;	// log2 of the number of words in a row (N/64)
+
 /*
  * Functions for initialization
  */
 
+// read an optional env variable as an integer. Return `default_value` if
+// it does not exist
+long read_optional_env_var(const char* name, long default_value) {
+	char* value = Getenv(name);
+	return value ? atol(value) : default_value;
+}
+
 // read and parse necessary env variables
 void read_env_vars() {
-	if (!Getenv("MINESWEEPER_LAUNCHED_BY_JUDGER")) {
-		app_error("This program (game server) is designed to be launched by \
+	daemon_socket_path = Getenv("MINESWEEPER_GS_DAEMON_SOCKET");
+	map_file_path = Getenv_must_exist("MINESWEEPER_MAP_FILE_PATH");
+	if (!daemon_socket_path) {
+		if (!Getenv("MINESWEEPER_LAUNCHED_BY_JUDGER")) {
+			app_error("This program (game server) is designed to be launched by \
 the judger. Please do not launch it directly.");
+		}
+		// In the daemon mode, these come with every session instead
+		fd_to_pl = atoi(Getenv_must_exist("MINESWEEPER_FD_GS_TO_PL"));
+		fd_from_pl = atoi(Getenv_must_exist("MINESWEEPER_FD_GS_FROM_PL"));
+		fd_to_ju = atoi(Getenv_must_exist("MINESWEEPER_FD_GS_TO_JU"));
+		fd_from_ju = atoi(Getenv_must_exist("MINESWEEPER_FD_GS_FROM_JU"));
+		shm_name = Getenv_must_exist("MINESWEEPER_SHM_NAME");
+		num_core_pairs = parse_core_pairs(core_pairs);
 	}
-	map_file_path = Getenv_must_exist("MINESWEEPER_MAP_FILE_PATH");
-	fd_to_pl = atoi(Getenv_must_exist("MINESWEEPER_FD_GS_TO_PL"));
-	fd_from_pl = atoi(Getenv_must_exist("MINESWEEPER_FD_GS_FROM_PL"));
-	fd_to_ju = atoi(Getenv_must_exist("MINESWEEPER_FD_GS_TO_JU"));
-	fd_from_ju = atoi(Getenv_must_exist("MINESWEEPER_FD_GS_FROM_JU"));
-	shm_name = Getenv_must_exist("MINESWEEPER_SHM_NAME");
+	use_adj_mine_table = read_optional_env_var("MINESWEEPER_GS_ADJ_MINE_TABLE", 1);
+	max_n_for_adj_mine_table = read_optional_env_var("MINESWEEPER_GS_ADJ_MINE_TABLE_MAX_N", 32768);
+	use_zero_comps = read_optional_env_var("MINESWEEPER_GS_ZERO_COMPONENTS", 0);
+	verify_summary = read_optional_env_var("MINESWEEPER_GS_VERIFY_SUMMARY", 0);
+	use_bitwise_bfs = read_optional_env_var("MINESWEEPER_GS_BITWISE_BFS", 1);
+	verify_flood = read_optional_env_var("MINESWEEPER_GS_VERIFY_FLOOD", 0);
+	collect_stats = read_optional_env_var("MINESWEEPER_GS_STATS", 0);
+	eager_open_bitmap = read_optional_env_var("MINESWEEPER_GS_OPEN_BITMAP", 0);
+	num_pool_threads = read_optional_env_var("MINESWEEPER_GS_POOL_THREADS", 0);
+	if (num_pool_threads < 0 || num_pool_threads > MAX_CHANNEL) {
+		app_error("MINESWEEPER_GS_POOL_THREADS must be in [0, MAX_CHANNEL].");
+	}
+	parked_max_chunks = read_optional_env_var("MINESWEEPER_GS_PARKED_CHUNKS", 64);
+	if (parked_max_chunks < 1) {
+		app_error("MINESWEEPER_GS_PARKED_CHUNKS must be positive.");
+	}
+	num_prespawn_workers = read_optional_env_var("MINESWEEPER_GS_PRESPAWN_WORKERS", 0);
+	if (num_prespawn_workers < 0 || num_prespawn_workers > MAX_CHANNEL) {
+		app_error("MINESWEEPER_GS_PRESPAWN_WORKERS must be in [0, MAX_CHANNEL].");
+	}
+	huge_page_mode = read_huge_page_mode();
+	char* layout = Getenv("MINESWEEPER_GS_BOARD_LAYOUT");
+	if (layout && !strcmp(layout, "tiled")) {
+		board_layout = BOARD_LAYOUT_TILED;
+	} else if (layout && strcmp(layout, "row")) {
+		app_error("MINESWEEPER_GS_BOARD_LAYOUT must be \"row\" or \"tiled\".");
+	}
+}
+
+// run_in_parallel - Run `routine` on NUM_PREPROCESS_THREAD threads, and wait
+// for all of them. The argument of the i-th thread is `(void*)(long)i`
+void run_in_parallel(void* (*routine)(void*)) {
+	pthread_t tids[NUM_PREPROCESS_THREAD];
+	for (int i = 0; i < NUM_PREPROCESS_THREAD; ++i) {
+		Pthread_create(tids+i, NULL, routine, (void*)(long)i);
+	}
+	for (int i = 0; i < NUM_PREPROCESS_THREAD; ++i) {
+		Pthread_join(tids[i], NULL);
+	}
+}
+
+// adj_mine_table_thread_routine: thread routine used in `build_adj_mine_table()`
+// The i-th thread is responsible for rows in
+// [thread_id*N/NUM_PREPROCESS_THREAD, (thread_id+1)*N/NUM_PREPROCESS_THREAD)
+//	It works row by row with sliding sums: it unpacks three adjacent rows of
+// `is_mine` into bytes, sums them up vertically, and then sums up every three
+// adjacent columns. All inner loops are branchless loops over byte arrays, so
+// the compiler is able to vectorize them (with -march=native).
+void* adj_mine_table_thread_routine(void* arg) {
+	long thread_id = (long)arg;
+	long row_start = thread_id*N/NUM_PREPROCESS_THREAD;
+	long row_end = (thread_id+1)*N/NUM_PREPROCESS_THREAD;
+	// rows[k][c+1] is whether (r-1+k, c) contains a mine. rows[k][0] and
+	// rows[k][N+1] are paddings and are always 0
+	uint8_t* rows[3];
+	for (int k = 0; k < 3; ++k) {
+		rows[k] = (uint8_t*)Calloc(N+2, 1);
+	}
+	uint8_t* col_sum = (uint8_t*)Calloc(N+2, 1);
+	uint8_t* count = (uint8_t*)Malloc(N);
+	auto unpack_row = [&](long r, uint8_t* dst) {
+		if (r < 0 || r >= N) {
+			memset(dst, 0, N+2);
+			return;
+		}
+		const uint8_t* src = (const uint8_t*)is_mine + (r<<logN)/8;
+		for (long i = 0; i < N/8; ++i) {
+			for (int j = 0; j < 8; ++j) {
+				dst[1+i*8+j] = src[i]>>j&0x1;
+			}
+		}
+	};
+	unpack_row(row_start-1, rows[0]);
+	unpack_row(row_start, rows[1]);
+	for (long r = row_start; r < row_end; ++r) {
+		unpack_row(r+1, rows[2]);
+		const uint8_t *up = rows[0], *mid = rows[1], *down = rows[2];
+		for (long c = 0; c < N+2; ++c) {
+			col_sum[c] = up[c] + mid[c] + down[c];
+		}
+		for (long c = 0; c < N; ++c) {
+			count[c] = col_sum[c] + col_sum[c+1] + col_sum[c+2] - mid[c+1];
+		}
+		uint8_t* dst = (uint8_t*)adj_mine_table + (r<<logN)/2;
+		for (long c = 0; c < N/2; ++c) {
+			dst[c] = count[c*2] | count[c*2+1]<<4;
+		}
+		// Slide the window down by one row
+		uint8_t* t = rows[0];
+		rows[0] = rows[1];
+		rows[1] = rows[2];
+		rows[2] = t;
+	}
+	for (int k = 0; k < 3; ++k) {
+		Free(rows[k]);
+	}
+	Free(col_sum);
+	Free(count);
+	return NULL;
+}
+
+// build_adj_mine_table - Fill in `adj_mine_table` with NUM_PREPROCESS_THREAD threads
+// Rows are unpacked a byte (8 grids) at a time, so N must be a multiple of 8
+void build_adj_mine_table() {
+	if (N%8) {
+		app_error("build_adj_mine_table: N must be a multiple of 8");
+	}
+	adj_mine_table = (char*)alloc_plane(N*N/2, huge_page_mode);
+	run_in_parallel(adj_mine_table_thread_routine);
+}
+
+// During labelling, roots of components are marked with this bit
+constexpr unsigned int ZERO_COMP_ROOT_FLAG = 1u<<31;
+
+inline bool is_zero_grid(long r, long c) {
+	if (r < 0 || c < 0 || r >= N || c >= N) return false;
+	return !test_is_mine(r, c) && !get_adj_mine(r, c);
+}
+
+// zero_comp_find - Find the root (an index) of the grid with index i
+// During labelling, zero_comp_id[i]-1 is the parent of i
+inline long zero_comp_find(long i) {
+	while (true) {
+		long parent = __atomic_load_n(zero_comp_id+i, __ATOMIC_RELAXED)-1;
+		if (parent == i) return i;
+		i = parent;
+	}
+}
+
+// zero_comp_union - Merge the components containing grid i and j
+// The root with the smaller index becomes the new root
+inline void zero_comp_union(long i, long j) {
+	i = zero_comp_find(i);
+	j = zero_comp_find(j);
+	if (i == j) return;
+	if (i > j) std::swap(i, j);
+	zero_comp_id[j] = i+1;
+	// Path compression is not needed here, since we make all grids point to
+	// their roots directly later
+}
+
+// Rows in [band_start(i), band_start(i+1)) are processed by the i-th thread
+inline long band_start(long thread_id) {
+	return thread_id*N/NUM_PREPROCESS_THREAD;
+}
+
+// Number of roots in each band, and then the ID of the first component in each band
+long zero_comp_band_base[NUM_PREPROCESS_THREAD+1];
+
+// Step 1: Label components inside each band
+void* zero_comp_label_band_routine(void* arg) {
+	long thread_id = (long)arg;
+	long row_start = band_start(thread_id), row_end = band_start(thread_id+1);
+	static constexpr int delta_xy[4][2] = {{0, -1}, {-1, -1}, {-1, 0}, {-1, 1}};
+	for (long r = row_start; r < row_end; ++r) {
+		for (long c = 0; c < N; ++c) {
+			long index = (r<<logN) + c;
+			if (!is_zero_grid(r, c)) {
+				zero_comp_id[index] = 0;
+				continue;
+			}
+			zero_comp_id[index] = index+1;
+			for (int k = 0; k < 4; ++k) {
+				long new_r = r + delta_xy[k][0];
+				long new_c = c + delta_xy[k][1];
+				if (new_r >= row_start && is_zero_grid(new_r, new_c)) {
+					zero_comp_union(index, (new_r<<logN) + new_c);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+// Step 3: Let every zero grid point to its root directly, and count roots
+// Other threads may be walking through the grid we are modifying, which is
+// fine since both the old and the new parent are ancestors of it
+void* zero_comp_flatten_routine(void* arg) {
+	long thread_id = (long)arg;
+	long index_start = band_start(thread_id)<<logN, index_end = band_start(thread_id+1)<<logN;
+	long num_roots = 0;
+	for (long i = index_start; i < index_end; ++i) {
+		if (zero_comp_id[i]) {
+			long root = zero_comp_find(i);
+			__atomic_store_n(zero_comp_id+i, root+1, __ATOMIC_RELAXED);
+			num_roots += root == i;
+		}
+	}
+	zero_comp_band_base[thread_id+1] = num_roots;
+	return NULL;
+}
+
+// Step 4: Assign IDs to roots
+void* zero_comp_assign_root_routine(void* arg) {
+	long thread_id = (long)arg;
+	long index_start = band_start(thread_id)<<logN, index_end = band_start(thread_id+1)<<logN;
+	long next_id = zero_comp_band_base[thread_id];
+	for (long i = index_start; i < index_end; ++i) {
+		if (zero_comp_id[i] == i+1) {
+			zero_comp_id[i] = next_id | ZERO_COMP_ROOT_FLAG;
+			next_id += 1;
+		}
+	}
+	return NULL;
+}
+
+// Step 5: Copy the ID from the root to other grids (roots are not modified)
+void* zero_comp_assign_rest_routine(void* arg) {
+	long thread_id = (long)arg;
+	long index_start = band_start(thread_id)<<logN, index_end = band_start(thread_id+1)<<logN;
+	for (long i = index_start; i < index_end; ++i) {
+		if (zero_comp_id[i] && !(zero_comp_id[i] & ZERO_COMP_ROOT_FLAG)) {
+			zero_comp_id[i] = zero_comp_id[zero_comp_id[i]-1];
+		}
+	}
+	return NULL;
+}
+
+// Step 6: Turn "ID | ZERO_COMP_ROOT_FLAG" into "ID + 1"
+void* zero_comp_strip_flag_routine(void* arg) {
+	long thread_id = (long)arg;
+	long index_start = band_start(thread_id)<<logN, index_end = band_start(thread_id+1)<<logN;
+	for (long i = index_start; i < index_end; ++i) {
+		if (zero_comp_id[i]) {
+			zero_comp_id[i] = (zero_comp_id[i] & ~ZERO_COMP_ROOT_FLAG) + 1;
+		}
+	}
+	return NULL;
+}
+
+// for_each_zero_comp_of_grid - Call `fn(id)` for every (distinct) component
+// that the non-mine grid (r, c) belongs to, or lies on the border of
+template<typename Fn>
+inline void for_each_zero_comp_of_grid(long r, long c, Fn fn) {
+	long ids[9];
+	int num_ids = 0;
+	for (long new_r = r-1; new_r <= r+1; ++new_r) {
+		for (long new_c = c-1; new_c <= c+1; ++new_c) {
+			if (new_r < 0 || new_c < 0 || new_r >= N || new_c >= N) continue;
+			long id = (long)zero_comp_id[(new_r<<logN) + new_c] - 1;
+			if (id < 0) continue;
+			bool seen = false;
+			for (int k = 0; k < num_ids; ++k) {
+				seen |= ids[k] == id;
+			}
+			if (!seen) {
+				ids[num_ids++] = id;
+				fn(id);
+			}
+		}
+	}
+}
+
+// Step 7: Count grids in each component
+// zero_comp_start[id+1] is used as the counter of component `id`
+void* zero_comp_count_routine(void* arg) {
+	long thread_id = (long)arg;
+	for (long r = band_start(thread_id); r < band_start(thread_id+1); ++r) {
+		for (long c = 0; c < N; ++c) {
+			if (test_is_mine(r, c)) continue;
+			for_each_zero_comp_of_grid(r, c, [&](long id) {
+				__atomic_fetch_add(zero_comp_start+id+1, 1, __ATOMIC_RELAXED);
+			});
+		}
+	}
+	return NULL;
+}
+
+// Step 8: Fill in the list of grids of each component
+// zero_comp_start[id] is used as the cursor of component `id`
+void* zero_comp_fill_routine(void* arg) {
+	long thread_id = (long)arg;
+	for (long r = band_start(thread_id); r < band_start(thread_id+1); ++r) {
+		for (long c = 0; c < N; ++c) {
+			if (test_is_mine(r, c)) continue;
+			for_each_zero_comp_of_grid(r, c, [&](long id) {
+				long pos = __atomic_fetch_add(zero_comp_start+id, 1, __ATOMIC_RELAXED);
+				zero_comp_grids[pos][0] = r;
+				zero_comp_grids[pos][1] = c;
+				zero_comp_grids[pos][2] = get_adj_mine(r, c);
+			});
+		}
+	}
+	return NULL;
+}
+
+// build_zero_comps - Label all zero components and build their lists of grids
+void build_zero_comps() {
+	zero_comp_id = (unsigned int*)alloc_plane(N*N*sizeof(unsigned int), huge_page_mode);
+	// Step 1 & 2: Label components inside each band, and then merge components
+	// across band boundaries
+	run_in_parallel(zero_comp_label_band_routine);
+	for (int i = 1; i < NUM_PREPROCESS_THREAD; ++i) {
+		long r = band_start(i);
+		if (r == band_start(i-1)) continue;
+		for (long c = 0; c < N; ++c) {
+			if (!zero_comp_id[(r<<logN) + c]) continue;
+			for (long new_c = c-1; new_c <= c+1; ++new_c) {
+				if (is_zero_grid(r-1, new_c)) {
+					zero_comp_union((r<<logN) + c, ((r-1)<<logN) + new_c);
+				}
+			}
+		}
+	}
+	// Step 3 ~ 6: Assign IDs, starting from 0
+	run_in_parallel(zero_comp_flatten_routine);
+	zero_comp_band_base[0] = 0;
+	for (int i = 0; i < NUM_PREPROCESS_THREAD; ++i) {
+		zero_comp_band_base[i+1] += zero_comp_band_base[i];
+	}
+	num_zero_comps = zero_comp_band_base[NUM_PREPROCESS_THREAD];
+	run_in_parallel(zero_comp_assign_root_routine);
+	run_in_parallel(zero_comp_assign_rest_routine);
+	run_in_parallel(zero_comp_strip_flag_routine);
+	// Step 7 & 8: Build the lists
+	zero_comp_start = (long*)Calloc(num_zero_comps+1, sizeof(long));
+	run_in_parallel(zero_comp_count_routine);
+	for (long i = 0; i < num_zero_comps; ++i) {
+		zero_comp_start[i+1] += zero_comp_start[i];
+	}
+	zero_comp_grids = (unsigned short (*)[3])Malloc(zero_comp_start[num_zero_comps]*sizeof(*zero_comp_grids));
+	run_in_parallel(zero_comp_fill_routine);
+	// Now zero_comp_start[i] is the end of the i-th list, so shift it
+	for (long i = num_zero_comps; i > 0; --i) {
+		zero_comp_start[i] = zero_comp_start[i-1];
+	}
+	zero_comp_start[0] = 0;
+	log("%ld zero components, %ld grids in their lists\n", num_zero_comps, zero_comp_start[num_zero_comps]);
+}
+
+// prefault_thread_routine: thread routine used in `read_map()`
+// The i-th thread touches one byte per page in the i-th part of the mapped map
+// file, so that page faults are handled by NUM_PREPROCESS_THREAD threads in
+// parallel, instead of by the first worker thread that reads the page
+void* prefault_thread_routine(void* arg) {
+	long thread_id = (long)arg;
+	long page_size = sysconf(_SC_PAGESIZE);
+	long num_pages = (map_file_size+page_size-1) / page_size;
+	long page_start = thread_id*num_pages/NUM_PREPROCESS_THREAD;
+	long page_end = (thread_id+1)*num_pages/NUM_PREPROCESS_THREAD;
+	volatile char sum = 0;
+	for (long i = page_start; i < page_end; ++i) {
+		sum += map_file_start[i*page_size];
+	}
+	return NULL;
+}
+
+// build_board_thread_routine: thread routine used in `build_board()`
+// The i-th thread is responsible for tile rows in
+// [thread_id*(N/8)/NUM_PREPROCESS_THREAD, (thread_id+1)*(N/8)/NUM_PREPROCESS_THREAD)
+//	The r-th row of a tile is just a byte of `is_mine`, so a tile is built
+// from 8 bytes
+void* build_board_thread_routine(void* arg) {
+	long thread_id = (long)arg;
+	long tile_row_start = thread_id*(N/8)/NUM_PREPROCESS_THREAD;
+	long tile_row_end = (thread_id+1)*(N/8)/NUM_PREPROCESS_THREAD;
+	const uint8_t* src = (const uint8_t*)is_mine;
+	for (long tr = tile_row_start; tr < tile_row_end; ++tr) {
+		for (long tc = 0; tc < N/8; ++tc) {
+			uint64_t word = 0;
+			for (long i = 0; i < 8; ++i) {
+				word |= (uint64_t)src[((tr*8+i)<<logN)/8 + tc] << (i*8);
+			}
+			long t = tile_index(tr*8, tc*8);
+			board[t*2] = word;
+			board[t*2+1] = 0;
+		}
+	}
+	return NULL;
+}
+
+// build_board - Build `board` (mine words and open words) from `is_mine`
+void build_board() {
+	board = (uint64_t*)alloc_plane(board_size(), huge_page_mode);
+	run_in_parallel(build_board_thread_routine);
+}
+
+// load_mine_word - The mines in grids (r, wc*64) ~ (r, wc*64+63), read
+// from the map file. Rows out of the map have no mines
+inline uint64_t load_mine_word(long r, long wc) {
+	if (r < 0 || r >= N) return 0;
+	uint64_t word;
+	memcpy(&word, is_mine + (r<<logN)/8 + wc*8, sizeof(word));	// May be unaligned
+	return word;
+}
+
+// zero_mask_thread_routine: thread routine used in `build_zero_mask()`
+// The i-th thread is responsible for rows in
+// [thread_id*(N/NUM_PREPROCESS_THREAD), (thread_id+1)*(N/NUM_PREPROCESS_THREAD))
+//	A grid is a zero grid iff there is no mine in the 3x3 square around it,
+// so we OR up three rows of mines, dilate it horizontally, and negate it
+void* zero_mask_thread_routine(void* arg) {
+	long thread_id = (long)arg;
+	long row_start = thread_id*(N/NUM_PREPROCESS_THREAD);
+	long row_end = (thread_id+1)*(N/NUM_PREPROCESS_THREAD);
+	long W = N/64;
+	for (long r = row_start; r < row_end; ++r) {
+		uint64_t prev = 0;	// The vertical OR of the previous word
+		uint64_t cur = load_mine_word(r-1, 0) | load_mine_word(r, 0) | load_mine_word(r+1, 0);
+		for (long wc = 0; wc < W; ++wc) {
+			uint64_t next = wc+1 < W ? load_mine_word(r-1, wc+1) | load_mine_word(r, wc+1) | load_mine_word(r+1, wc+1) : 0;
+			uint64_t dilated = cur | cur<<1 | cur>>1 | prev>>63 | next<<63;
+			zero_mask[(r<<logW) + wc] = ~dilated;
+			prev = cur;
+			cur = next;
+		}
+	}
+	return NULL;
+}
+
+// build_zero_mask - Build `zero_mask` from `is_mine`
+void build_zero_mask() {
+	logW = logN-6;
+	zero_mask = (uint64_t*)alloc_plane(N*N/8, huge_page_mode);
+	run_in_parallel(zero_mask_thread_routine);
 }
 
 // read and parse the map
+//	We `mmap` the map file instead of reading it, and `is_mine` points to
+// the payload after the header directly. So the content of the file is
+// never copied. (MAP_POPULATE would also prefault the mapping, but the
+// kernel does it with only one thread)
 void read_map() {
-	FILE* map_file = fopen(map_file_path, "r");
-	if (!map_file) {
+	int map_file_fd = open(map_file_path, O_RDONLY);
+	if (map_file_fd < 0) {
 		unix_error("Failed to open the map file");
 	}
+	struct stat map_file_stat;
+	Fstat(map_file_fd, &map_file_stat);
+	map_file_size = map_file_stat.st_size;
+	map_file_start = (char*)Mmap(NULL, map_file_size, PROT_READ, MAP_PRIVATE, map_file_fd, 0);
+	Close(map_file_fd);
+	madvise(map_file_start, map_file_size, MADV_WILLNEED);
+	advise_huge_pages(map_file_start, map_file_size, huge_page_mode);
 
-	if (fscanf(map_file, "%ld %ld\n", &N, &K) != 2) {
+	// The header looks like "N K\n"
+	char header[64] = {0};
+	memcpy(header, map_file_start, min(map_file_size, (long)sizeof(header)-1));
+	char* header_end = strchr(header, '\n');
+	if (!header_end || sscanf(header, "%ld %ld", &N, &K) != 2) {
 		app_error("Failed to read N and K. Maybe the map file is broken?");
 	}
 
 	log("Map info: N = %ld, K = %ld\n", N, K);
 	logN = (long)(log2((double)N)+0.01);
 
-	Fseek(map_file, 0, SEEK_SET);
-	char c;
-	while ((c = fgetc(map_file)) != '\n');
-
-	is_mine = (char*)Malloc(N*N/8);
-	size_t byte_read = fread(is_mine, 1, N*N/8, map_file);
-	if (byte_read != N*N/8) {
-		log("%u bytes read\n", byte_read);
+	long header_len = header_end-header+1;
+	if (map_file_size-header_len < N*N/8) {
+		log("%ld bytes read\n", map_file_size-header_len);
 		app_error("Failed to read the map. Maybe the map file is broken?");
 	}
+	is_mine = map_file_start + header_len;
+
+	run_in_parallel(prefault_thread_routine);
 
-	Fclose(map_file);
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		build_board();
+	}
+	if (use_adj_mine_table) {
+		if (N > max_n_for_adj_mine_table) {
+			log("The adjacent mine table is disabled since N > %ld (see MINESWEEPER_GS_ADJ_MINE_TABLE_MAX_N)\n",
+				max_n_for_adj_mine_table);
+			use_adj_mine_table = false;
+		} else if (N%8) {
+			log("The adjacent mine table is disabled since N is not a multiple of 8\n");
+			use_adj_mine_table = false;
+		} else {
+			build_adj_mine_table();
+		}
+	}
+	if (use_bitwise_bfs) {
+		if (N < 64) {
+			log("Bitwise BFS is disabled since N < 64\n");
+			use_bitwise_bfs = false;
+		} else {
+			build_zero_mask();
+		}
+	}
+	if (use_zero_comps) {
+		if (N > MAX_N_FOR_ZERO_COMPS) {
+			log("Zero components are disabled since N > %ld\n", MAX_N_FOR_ZERO_COMPS);
+			use_zero_comps = false;
+		} else {
+			build_zero_comps();
+		}
+	}
 }
 
 
@@ -192,8 +1086,21 @@ void read_map() {
 // summarize_thread_routine: thread routine used in `summarize()`
 // The i-th thread is responsible for rows in
 // [thread_id*(N/NUM_SUMMARIZE_THREAD), (thread_id+1)*(N/NUM_SUMMARIZE_THREAD))
+// (or the same share of tiles in the tiled layout)
 void* summarize_thread_routine(void* arg) {
 	long thread_id = (long)arg;
+	pair<long, long>* result = (pair<long, long>*)Malloc(sizeof(pair<long, long>));
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		long num_tiles = (N/8)*(N/8);
+		long tile_start = thread_id*num_tiles/NUM_SUMMARIZE_THREAD;
+		long tile_end = (thread_id+1)*num_tiles/NUM_SUMMARIZE_THREAD;
+		result->first = result->second = 0;
+		for (long t = tile_start; t < tile_end; ++t) {
+			result->first += __builtin_popcountl(~board[t*2]&board[t*2+1]);
+			result->second += __builtin_popcountl(board[t*2]&board[t*2+1]);
+		}
+		return result;
+	}
 	long row_start = thread_id*(N/NUM_SUMMARIZE_THREAD);
 	long row_end = (thread_id+1)*(N/NUM_SUMMARIZE_THREAD);
 	long index_start = row_start*N/8;
@@ -205,32 +1112,83 @@ void* summarize_thread_routine(void* arg) {
 		cnt_non_mine += __builtin_popcount((uint8_t)(~is_mine[i]&is_open[i]));
 		cnt_is_mine += __builtin_popcount((uint8_t)(is_mine[i]&is_open[i]));
 	}
-	pair<long, long>* result = (pair<long, long>*)Malloc(sizeof(pair<long, long>));
 	result->first = cnt_non_mine;
 	result->second = cnt_is_mine;
 	return result;
 }
 
+// log_stats - Log the statistics of all worker threads
+void log_stats() {
+	long num_bfs = 0, num_bfs_grids = 0, bfs_ns = 0;
+	for (int i = 0; i < MAX_CHANNEL; ++i) {
+		num_bfs += worker_stats[i].num_bfs;
+		num_bfs_grids += worker_stats[i].num_bfs_grids;
+		bfs_ns += worker_stats[i].bfs_ns;
+	}
+	log("Stats: layout = %s, %ld BFS, %ld grids, %.3f s, %.2f M grids/s\n",
+		board_layout == BOARD_LAYOUT_TILED ? "tiled" : "row",
+		num_bfs, num_bfs_grids, bfs_ns/1e9,
+		bfs_ns ? num_bfs_grids*1e3/bfs_ns : 0.0);
+	long num_spin_hits = 0, num_futex_sleeps = 0, num_pure_spin_waits = 0;
+	long num_client_wakes = 0;
+	for (int i = 0; i < MAX_CHANNEL; ++i) {
+		num_spin_hits += worker_stats[i].num_spin_hits;
+		num_futex_sleeps += worker_stats[i].num_futex_sleeps;
+		num_pure_spin_waits += worker_stats[i].num_pure_spin_waits;
+		num_client_wakes += worker_stats[i].num_client_wakes;
+	}
+	long num_waits = num_spin_hits + num_futex_sleeps;
+	log("Stats: %ld spin hits (%ld in pure spin mode), %ld futex sleeps, %.2f%% hit\n",
+		num_spin_hits, num_pure_spin_waits, num_futex_sleeps,
+		num_waits ? num_spin_hits*100.0/num_waits : 0.0);
+	log("Stats: %ld wake-ups of sleeping player's threads\n", num_client_wakes);
+}
+
 // summarize - Send the number of opened non-mine grids and opened is-mine
 // grids to the judger, through fd_to_ju
+//	The numbers come from the counters in `set_is_open()`. If `verify_summary`
+// is true, we also scan the whole map with NUM_SUMMARIZE_THREAD threads and
+// report the result of the scan.
 void summarize() {
+	// The threads are cancelled asynchronously, so they may still be running
+	// for a moment. Wait for them before reading their counters
 	kill_worker_threads();
-	if (N%NUM_SUMMARIZE_THREAD != 0) {
-		app_error("NUM_SUMMARIZE_THREAD must be a factor of N.");
-	}
-	// Create the threads for counting
-	pthread_t tids[NUM_SUMMARIZE_THREAD];
-	for (int i = 0; i < NUM_SUMMARIZE_THREAD; ++i) {
-		Pthread_create(tids+i, NULL, summarize_thread_routine, (void*)(long)i);
-	}
-	// Join those threads
+	join_worker_threads();
+	// Sum up the counters of all worker threads
 	long cnt_non_mine = 0;
 	long cnt_is_mine = 0;
-	for (int i = 0; i < NUM_SUMMARIZE_THREAD; ++i) {
-		pair<long, long>* result;
-		Pthread_join(tids[i], (void**)&result);
-		cnt_non_mine += result->first;
-		cnt_is_mine += result->second;
+	for (int i = 0; i < MAX_CHANNEL; ++i) {
+		cnt_non_mine += open_counters[i].cnt_non_mine;
+		cnt_is_mine += open_counters[i].cnt_is_mine;
+	}
+	if (verify_summary) {
+		// Scan the whole map, and compare the result with the counters
+		if (N%NUM_SUMMARIZE_THREAD != 0) {
+			app_error("NUM_SUMMARIZE_THREAD must be a factor of N.");
+		}
+		// Create the threads for counting
+		pthread_t tids[NUM_SUMMARIZE_THREAD];
+		for (int i = 0; i < NUM_SUMMARIZE_THREAD; ++i) {
+			Pthread_create(tids+i, NULL, summarize_thread_routine, (void*)(long)i);
+		}
+		// Join those threads
+		long scan_cnt_non_mine = 0;
+		long scan_cnt_is_mine = 0;
+		for (int i = 0; i < NUM_SUMMARIZE_THREAD; ++i) {
+			pair<long, long>* result;
+			Pthread_join(tids[i], (void**)&result);
+			scan_cnt_non_mine += result->first;
+			scan_cnt_is_mine += result->second;
+		}
+		if (scan_cnt_non_mine != cnt_non_mine || scan_cnt_is_mine != cnt_is_mine) {
+			log("Warning: Counters (%ld, %ld) differ from the scan result (%ld, %ld). The latter is reported\n",
+				cnt_non_mine, cnt_is_mine, scan_cnt_non_mine, scan_cnt_is_mine);
+		}
+		cnt_non_mine = scan_cnt_non_mine;
+		cnt_is_mine = scan_cnt_is_mine;
+	}
+	if (collect_stats) {
+		log_stats();
 	}
 	// Send it to the judger, via fd_to_ju
 	// Format: "Status N K cnt_non_mine cnt_is_mine"
@@ -239,8 +1197,18 @@ void summarize() {
 		0, N, K, cnt_non_mine, cnt_is_mine);
 	Write(fd_to_ju, buf, strlen(buf)+1);
 	// Clean up and exit
-	Free(is_mine);
-	Free(is_open);
+	Munmap(map_file_start, map_file_size);
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		free_plane(board, board_size(), huge_page_mode);
+	} else {
+		free_plane(is_open, N*N/8, huge_page_mode);
+	}
+	if (use_adj_mine_table) {
+		free_plane(adj_mine_table, N*N/2, huge_page_mode);
+	}
+	if (use_bitwise_bfs) {
+		free_plane(zero_mask, N*N/8, huge_page_mode);
+	}
 	exit(0);
 }
 
@@ -251,68 +1219,129 @@ void summarize() {
 // A vector for maintaining all the tids of worker threads.
 pthread_mutex_t worker_thread_tids_mutex = PTHREAD_MUTEX_INITIALIZER;
 vector<pthread_t> worker_thread_tids;
+// Whether `kill_worker_threads()` is called. Threads registered after it exit at once
+bool worker_threads_killed = false;
 
-// The channel_id of the next channel, starting from 0
+// The channel_id of the next channel, starting from 0. Channels with smaller
+// IDs have all been created (and may have been closed since then)
 atomic<int> next_channel_id = 0;
 
-// For BFS. Mark whether a grid is visited
-// We call `vis[i]` as "The i-th level"
-char* vis[NUM_ACTIVE_WORKER_THREAD];
-char test_is_vis(int level, long r, long c) {
-	if (r < 0 || c < 0 || r >= N || c >= N) return 1;
-	long index = (r<<logN) + c;
-	long number = index/8, offset = index%8;
-	return vis[level][number]>>offset&0x1;
-}
-void set_is_vis(int level, long r, long c) {
-	long index = (r<<logN) + c;
-	long number = index/8, offset = index%8;
-	vis[level][number] |= 0x1<<offset;
-}
-void unset_is_vis_area(int level, long r, long c) {
-	long index = (r<<logN) + c;
-	long number = index/8;
-	vis[level][number] = 0;
-}
+// IDs of closed channels, which are reused before new IDs are allocated
+pthread_mutex_t free_channel_ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+vector<int> free_channel_ids;
+// IDs of closed channels whose shm regions may still be touched by the
+// player's program (see `release_channel_id()`). Also protected by
+// `free_channel_ids_mutex`
+vector<int> closing_channel_ids;
 
-// Queues for BFS
-Queue queues[NUM_ACTIVE_WORKER_THREAD];
+// For BFS. Each worker thread has its own queue and set of visited grids,
+// whose sizes are proportional to the largest region the thread has expanded
+// (instead of N*N), so any number of threads can do BFS at the same time.
+// They are allocated on the first BFS of the thread
+thread_local Queue* bfs_queue;
+thread_local VisitedSet* bfs_vis;
+constexpr long BFS_VIS_INITIAL_CAPACITY = 4096;
+constexpr long BFS_QUEUE_INITIAL_CAPACITY = 1024;
 
-// For BFS. `vis_occupied_flags[i]` marks whether `vis[i]` is in use by some thread
-atomic_flag vis_occupied_flags[NUM_ACTIVE_WORKER_THREAD];
+/*
+ * Replies
+ *	A reply holds at most MAX_OPEN_GRID grids. Grids opened by a click are put
+ * into a `ReplyWriter`, and when the current chunk is full, `flush()`
+ * publishes it to the player's program with the "more" flag and moves on to
+ * the buffer of the next chunk (see "Streaming of large results" in `shm.h`).
+ * So a region of any size is streamed through a bounded buffer, and the
+ * player's program can consume a chunk while the next one is produced.
+ *	With `runs` (SHM_CLICK_FLAG_RUNS), a grid right after the last grid of
+ * the last run (in the same row) extends that run, and any other grid starts
+ * a new one (see "Run-length replies" in `shm.h`). The expansions put the
+ * grids of a row next to each other anyway, so a large region takes about
+ * 1/9 of the entries it takes otherwise.
+ */
+struct ReplyWriter {
+	unsigned short (*arr)[3];	// The buffer of the current chunk
+	long count;	// The number of entries in the current chunk
+	long num_chunks;	// The number of published chunks
+	void (*flush)(ReplyWriter &writer);
+	void* ctx;	// Used by `flush`
+	bool runs = false;	// Whether grids are put into runs
+	long run = -1;	// The index of the header of the last run in `arr`, or -1
+	long num_grids = 0;	// The number of grids in all chunks
 
-// find_available_level - find a available in `vis[]`, by spinning around `vis_occupied_flags`
-int find_available_level() {
-	while (true) {
-		for (int i = 0; i < NUM_ACTIVE_WORKER_THREAD; ++i) {
-			if (vis_occupied_flags[i].test_and_set() == 0)
-				return i;
+	inline void append(long r, long c, long number) {
+		num_grids += 1;
+		if (runs) {
+			append_to_run(r, c, number);
+			return;
 		}
+		if (count == MAX_OPEN_GRID) {
+			flush(*this);
+		}
+		arr[count][0] = r;
+		arr[count][1] = c;
+		arr[count][2] = number;
+		count += 1;
+	}
+	// The number of grids in all chunks
+	long total() const {
+		return num_grids;
 	}
-}
-// release_level - release a level
-void release_level(int level) {
-	vis_occupied_flags[level].clear();
-}
 
-void worker_thread_bfs(
-	int click_r, int click_c,
-	const int level,
-	long &result_open_count,
-	unsigned short result_arr[MAX_OPEN_GRID][3]
-) {
-	static constexpr int delta_xy[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
-	Queue &q = queues[level];
-	std::function<void(long, long)> append_to_result = [&](long r, long c) {
-		result_arr[result_open_count][0] = r;
-		result_arr[result_open_count][1] = c;
-		result_arr[result_open_count][2] = get_adj_mine(r, c);
-		result_open_count += 1;
+private:
+	// new_entry - Take the next entry of the current chunk, and clear it
+	inline unsigned short* new_entry() {
+		unsigned short* entry = arr[count++];
+		entry[0] = entry[1] = entry[2] = 0;
+		return entry;
+	}
+	// append_to_run - `append()` with runs
+	inline void append_to_run(long r, long c, long number) {
+		if (run >= 0) {
+			unsigned short* header = arr[run];
+			long len = header[2];
+			if (header[0] == r && header[1]+len == c && len < SHM_MAX_RUN_LENGTH
+				&& (len%SHM_RUN_GRIDS_PER_ENTRY || count < MAX_OPEN_GRID)) {
+				if (len%SHM_RUN_GRIDS_PER_ENTRY == 0) {
+					new_entry();
+				}
+				((unsigned char*)arr[run+1])[len/2] |= number<<(len%2*4);
+				header[2] = len+1;
+				return;
+			}
+		}
+		// Start a new run, which takes 2 entries
+		if (count+2 > MAX_OPEN_GRID) {
+			flush(*this);
+		}
+		run = count;
+		unsigned short* header = new_entry();
+		header[0] = r;
+		header[1] = c;
+		header[2] = 1;
+		((unsigned char*)new_entry())[0] = number;
+	}
+};
+
+void worker_thread_bfs(int click_r, int click_c, bool new_only, ReplyWriter &writer) {
+	static constexpr int delta_xy[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+	if (!bfs_queue) {
+		int oldstate = Defer_cancel();
+		bfs_queue = (Queue*)Malloc(sizeof(Queue));
+		bfs_queue->init(BFS_QUEUE_INITIAL_CAPACITY);
+		bfs_vis = (VisitedSet*)Malloc(sizeof(VisitedSet));
+		bfs_vis->init(BFS_VIS_INITIAL_CAPACITY);
+		Restore_cancel(oldstate);
+	}
+	Queue &q = *bfs_queue;
+	VisitedSet &vis = *bfs_vis;
+	auto append_to_result = [&](long r, long c) {
+		if (set_is_open(r, c) || !new_only) {
+			writer.append(r, c, get_adj_mine(r, c));
+		}
 	};
-	result_open_count = 0;
 	q.clear();
+	vis.clear();
 	q.push(click_r, click_c);
-	set_is_vis(level, click_r, click_c);
+	vis.insert((click_r<<logN) + click_c);
 	append_to_result(click_r, click_c);
 	while (!q.empty()) {
 		int r, c;
@@ -320,35 +1349,824 @@ void worker_thread_bfs(
 		for (int k = 0; k < 8; ++k) {
 			int new_r = r + delta_xy[k][0];
 			int new_c = c + delta_xy[k][1];
-			if (!test_is_vis(level, new_r, new_c) && !test_is_mine(new_r, new_c)) {
+			if (new_r < 0 || new_c < 0 || new_r >= N || new_c >= N) continue;
+			if (!test_is_mine(new_r, new_c) && vis.insert((new_r<<logN) + new_c)) {
 				append_to_result(new_r, new_c);
-				set_is_vis(level, new_r, new_c);
 				if (!get_adj_mine(new_r, new_c)) {
 					q.push(new_r, new_c);
 				}
 			}
 		}
 	}
-	// Clean up vis[level]
-	for (int i = 0; i < result_open_count; ++i) {
-		unset_is_vis_area(level, result_arr[i][0], result_arr[i][1]);
+}
+
+// For the bit-parallel flood fill. Like `bfs_vis`, they are allocated on the
+// first flood fill of the thread. They map word indexes, i.e.
+// (r<<logW) + wc, to words of grids (see `WordMap::set_word()`)
+thread_local WordMap* flood_region;	// The zero grids reached
+thread_local WordMap* flood_expanded;	// The zero grids whose neighbours are added
+thread_local WordMap* flood_result;	// The grids to be opened
+thread_local long* flood_stack;	// Keys of words in `flood_region` to be expanded
+thread_local long flood_stack_top, flood_stack_capacity;
+thread_local long* flood_result_keys;	// Keys of `flood_result`, in insertion order
+thread_local long flood_num_result_keys, flood_result_keys_capacity;
+constexpr long FLOOD_INITIAL_CAPACITY = 1024;
+
+// push_flood_key - Append `key` to the growable array `arr`
+inline void push_flood_key(long* &arr, long &size, long &capacity, long key) {
+	if (size == capacity) {
+		capacity *= 2;
+		int oldstate = Defer_cancel();
+		arr = (long*)Realloc(arr, capacity*sizeof(long));
+		Restore_cancel(oldstate);
+	}
+	arr[size++] = key;
+}
+
+// shrink_flood_keys - Shrink the growable array `arr` back to
+// FLOOD_INITIAL_CAPACITY if the last flood fill used less than 1/8 of it
+// (`used` is the number of result keys, which also bounds the stack well)
+inline void shrink_flood_keys(long* &arr, long &capacity, long used) {
+	if (capacity > FLOOD_INITIAL_CAPACITY && used*8 < capacity) {
+		capacity = FLOOD_INITIAL_CAPACITY;
+		int oldstate = Defer_cancel();
+		arr = (long*)Realloc(arr, capacity*sizeof(long));
+		Restore_cancel(oldstate);
 	}
-	// Open those grids
-	for (int i = 0; i < result_open_count; ++i) {
-		set_is_open(result_arr[i][0], result_arr[i][1]);
+}
+
+// fill_row - Extend `seeds` to the whole runs of 1s in `mask` containing them
+// (`seeds` must be a subset of `mask`). It is a Kogge-Stone fill in both
+// directions
+inline uint64_t fill_row(uint64_t seeds, uint64_t mask) {
+	uint64_t up = seeds, down = seeds;
+	uint64_t up_mask = mask, down_mask = mask;
+	for (int shift = 1; shift < 64; shift *= 2) {
+		up |= up_mask & (up<<shift);
+		up_mask &= up_mask<<shift;
+		down |= down_mask & (down>>shift);
+		down_mask &= down_mask>>shift;
 	}
+	return up | down;
 }
 
-// worker_thread_routine - Thread routine for a worker thread
-void* worker_thread_routine(void* arg) {
+// flood_add_seeds - Add zero grids in `bits` of the word (r, wc) to the
+// region, and schedule the word to be expanded if anything is new
+inline void flood_add_seeds(long r, long wc, uint64_t bits) {
+	if (r < 0 || r >= N) return;
+	long key = (r<<logW) + wc;
+	bits &= zero_mask[key];
+	if (!bits) return;
+	if (!(bits & ~flood_region->set_word(key, bits))) return;
+	push_flood_key(flood_stack, flood_stack_top, flood_stack_capacity, key);
+}
+
+// flood_add_result_word - Add grids in `bits` of the word `key` to the result
+inline void flood_add_result_word(long key, uint64_t bits) {
+	if (!flood_result->set_word(key, bits)) {
+		// A new key, as words are never 0
+		push_flood_key(flood_result_keys, flood_num_result_keys, flood_result_keys_capacity, key);
+	}
+}
+
+// flood_add_result - Add grids in `bits` (and the grids next to them) in the
+// rows r-1 ~ r+1 to the result
+inline void flood_add_result(long r, long wc, uint64_t bits) {
+	long W = N/64;
+	uint64_t dilated = bits | bits<<1 | bits>>1;
+	for (long nr = max(r-1, 0L); nr <= min(r+1, N-1); ++nr) {
+		flood_add_result_word((nr<<logW) + wc, dilated);
+		if (bits>>63 && wc+1 < W) {
+			flood_add_result_word((nr<<logW) + wc+1, 1);
+		}
+		if (bits&1 && wc > 0) {
+			flood_add_result_word((nr<<logW) + wc-1, 1UL<<63);
+		}
+	}
+}
+
+// worker_thread_flood - Expand the zero grid (click_r, click_c) like
+// `worker_thread_bfs()`, with the bit-parallel flood fill
+//	The clicked grid is the first grid in the result (if it is in the result),
+// and the others are in row-major order inside every word
+void worker_thread_flood(int click_r, int click_c, bool new_only, ReplyWriter &writer) {
+	long W = N/64;
+	if (!flood_region) {
+		int oldstate = Defer_cancel();
+		flood_region = (WordMap*)Malloc(sizeof(WordMap));
+		flood_region->init(FLOOD_INITIAL_CAPACITY);
+		flood_expanded = (WordMap*)Malloc(sizeof(WordMap));
+		flood_expanded->init(FLOOD_INITIAL_CAPACITY);
+		flood_result = (WordMap*)Malloc(sizeof(WordMap));
+		flood_result->init(FLOOD_INITIAL_CAPACITY);
+		flood_stack_capacity = FLOOD_INITIAL_CAPACITY;
+		flood_stack = (long*)Malloc(flood_stack_capacity*sizeof(long));
+		flood_result_keys_capacity = FLOOD_INITIAL_CAPACITY;
+		flood_result_keys = (long*)Malloc(flood_result_keys_capacity*sizeof(long));
+		Restore_cancel(oldstate);
+	}
+	shrink_flood_keys(flood_stack, flood_stack_capacity, flood_num_result_keys);
+	shrink_flood_keys(flood_result_keys, flood_result_keys_capacity, flood_num_result_keys);
+	flood_region->clear();
+	flood_expanded->clear();
+	flood_result->clear();
+	flood_stack_top = 0;
+	flood_num_result_keys = 0;
+	// Grow the region until a fixed point is reached. The result is the region
+	// and the grids next to it, which is added along the way
+	flood_add_seeds(click_r, click_c/64, 1UL<<(click_c%64));
+	while (flood_stack_top) {
+		long key = flood_stack[--flood_stack_top];
+		uint64_t bits = fill_row(flood_region->test_word(key), zero_mask[key]);
+		// Only the grids not expanded before are new
+		bits &= ~flood_expanded->set_word(key, bits);
+		if (!bits) continue;
+		flood_region->set_word(key, bits);
+		long r = key>>logW, wc = key&(W-1);
+		flood_add_result(r, wc, bits);
+		uint64_t dilated = bits | bits<<1 | bits>>1;
+		flood_add_seeds(r-1, wc, dilated);
+		flood_add_seeds(r+1, wc, dilated);
+		if (bits>>63 && wc+1 < W) {
+			for (long nr = r-1; nr <= r+1; ++nr) flood_add_seeds(nr, wc+1, 1);
+		}
+		if (bits&1 && wc > 0) {
+			for (long nr = r-1; nr <= r+1; ++nr) flood_add_seeds(nr, wc-1, 1UL<<63);
+		}
+	}
+	// Extract the grids, and open them. The clicked grid is opened first, so
+	// that it can go first in the result. For runs, the words are sorted, so
+	// that the grids of a row are put into the result from left to right
+	auto append_to_result = [&](long r, long c) {
+		writer.append(r, c, get_adj_mine(r, c));
+	};
+	if (set_is_open(click_r, click_c) || !new_only) {
+		append_to_result(click_r, click_c);
+	}
+	if (writer.runs) {
+		sort(flood_result_keys, flood_result_keys + flood_num_result_keys);
+	}
+	for (long i = 0; i < flood_num_result_keys; ++i) {
+		long key = flood_result_keys[i];
+		long r = key>>logW, wc = key&(W-1);
+		uint64_t bits = flood_result->test_word(key);
+		uint64_t newly_opened = set_is_open_word(r, wc, bits);
+		if (new_only) {
+			bits = newly_opened;
+		}
+		if (r == click_r && wc == click_c/64) {
+			bits &= ~(1UL<<(click_c%64));
+		}
+		while (bits) {
+			append_to_result(r, wc*64 + __builtin_ctzl(bits));
+			bits &= bits-1;
+		}
+	}
+}
+
+/*
+ * Checking the flood fill
+ *	With MINESWEEPER_GS_VERIFY_FLOOD, before the game starts, the game server
+ * clicks every zero grid which is not opened yet (in row-major order) with
+ * both `worker_thread_bfs()` and `worker_thread_flood()`, with `new_only` and
+ * then without it. The two expansions work on two copies of the open state
+ * (`is_open`, or `board` in the tiled layout), so with `new_only` they are
+ * compared on the same grids opened by earlier clicks. The grids returned
+ * are compared as sets, by their number and an order-independent hash. If
+ * any click differs, the BFS is used. The open state is cleared afterwards.
+ */
+
+// VerifyReply - The context of a `ReplyWriter` for checking the flood fill
+struct VerifyReply {
+	unsigned short (*arr)[3];	// MAX_OPEN_GRID entries
+	long num_grids;
+	uint64_t hash;	// The sum of `mix_grid()` of the grids
+};
+
+// mix_grid - A 64-bit hash of a grid in a reply
+inline uint64_t mix_grid(long r, long c, long number) {
+	uint64_t x = (uint64_t)r<<36 | (uint64_t)c<<4 | number;
+	x = (x ^ x>>30) * 0xBF58476D1CE4E5B9ul;
+	x = (x ^ x>>27) * 0x94D049BB133111EBul;
+	return x ^ x>>31;
+}
+
+// flush_verify_chunk - Add the grids of the current chunk to the hash
+void flush_verify_chunk(ReplyWriter &writer) {
+	VerifyReply* reply = (VerifyReply*)writer.ctx;
+	for (long i = 0; i < writer.count; ++i) {
+		reply->hash += mix_grid(writer.arr[i][0], writer.arr[i][1], writer.arr[i][2]);
+	}
+	reply->num_grids += writer.count;
+	writer.num_chunks += 1;
+	writer.count = 0;
+}
+
+// verify_expansion - Expand the zero grid (r, c) with the BFS or the flood
+// fill, and fill in `reply`
+void verify_expansion(long r, long c, bool bitwise, bool new_only, VerifyReply &reply) {
+	reply.num_grids = 0;
+	reply.hash = 0;
+	ReplyWriter writer = {reply.arr, 0, 0, flush_verify_chunk, &reply};
+	if (bitwise) {
+		worker_thread_flood(r, c, new_only, writer);
+	} else {
+		worker_thread_bfs(r, c, new_only, writer);
+	}
+	flush_verify_chunk(writer);
+}
+
+// clear_open_state - Close all grids
+void clear_open_state() {
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		for (long t = 0; t < (N/8)*(N/8); ++t) {
+			board[t*2+1] = 0;
+		}
+	} else {
+		memset(is_open, 0, N*N/8);
+	}
+}
+
+// verify_flood_fill - Check the flood fill against the BFS (see "Checking the
+// flood fill"). Only for the main thread, before the game starts
+void verify_flood_fill() {
+	if (!use_bitwise_bfs) {
+		log("The flood fill is not checked since it is disabled\n");
+		return;
+	}
+	// The open state of the flood fill. Swapped with the one of the BFS
+	char* other_open = NULL;
+	uint64_t* other_board = NULL;
+	if (board_layout == BOARD_LAYOUT_TILED) {
+		other_board = (uint64_t*)Malloc(board_size());
+		memcpy(other_board, board, board_size());
+	} else {
+		other_open = (char*)Calloc(N*N/8, 1);
+	}
+	auto swap_open_state = [&]() {
+		swap(is_open, other_open);
+		swap(board, other_board);
+	};
+	OpenCounter counter = {};
+	my_open_counter = &counter;
+	VerifyReply replies[2][2];	// [bitwise][new_only]
+	for (auto &by_mode : replies) {
+		for (auto &reply : by_mode) {
+			reply.arr = (unsigned short (*)[3])Malloc(MAX_OPEN_GRID*sizeof(*reply.arr));
+		}
+	}
+	long W = N/64, num_clicks = 0, num_mismatches = 0;
+	for (long r = 0; r < N; ++r) {
+		for (long wc = 0; wc < W; ++wc) {
+			for (uint64_t bits = zero_mask[(r<<logW) + wc]; bits; bits &= bits-1) {
+				long c = wc*64 + __builtin_ctzl(bits);
+				if (test_is_open(r, c)) continue;
+				for (int bitwise = 0; bitwise < 2; ++bitwise) {
+					verify_expansion(r, c, bitwise, true, replies[bitwise][1]);
+					verify_expansion(r, c, bitwise, false, replies[bitwise][0]);
+					swap_open_state();
+				}
+				num_clicks += 1;
+				bool differs = false;
+				for (int new_only = 0; new_only < 2; ++new_only) {
+					VerifyReply &bfs = replies[0][new_only], &flood = replies[1][new_only];
+					if (bfs.num_grids != flood.num_grids || bfs.hash != flood.hash) {
+						if (num_mismatches < 10) {
+							log("Error! The flood fill differs from the BFS at (%ld, %ld) (new_only: %d, grids: %ld vs %ld)\n",
+								r, c, new_only, flood.num_grids, bfs.num_grids);
+						}
+						differs = true;
+					}
+				}
+				num_mismatches += differs;
+			}
+		}
+	}
+	for (auto &by_mode : replies) {
+		for (auto &reply : by_mode) {
+			Free(reply.arr);
+		}
+	}
+	my_open_counter = NULL;
+	Free(other_open);
+	Free(other_board);
+	clear_open_state();
+	if (num_mismatches) {
+		log("Warning: the flood fill differs from the BFS in %ld of %ld clicks. The BFS is used\n",
+			num_mismatches, num_clicks);
+		use_bitwise_bfs = false;
+	} else {
+		log("The flood fill matches the BFS in all %ld clicks\n", num_clicks);
+	}
+}
+
+/*
+ * Delta-only replies
+ *	Clicking a zero grid returns its whole zero component and the border,
+ * even if most of them have been opened before, e.g. when several threads of
+ * the player's program expand overlapping regions. With `new_only`
+ * (SHM_CLICK_FLAG_NEW_ONLY), only the grids whose bit in `is_open` is turned
+ * from 0 to 1 by this request are returned, as told by the fetch-or in
+ * `set_is_open()` / `set_is_open_word()`. Every grid of the expansion is
+ * still opened, so only the reply gets smaller. Clicks on mines and on
+ * non-zero grids are not affected.
+ */
+
+// serve_click - Serve a single `click()` request
+// It puts the opened grids into `writer` and returns the value for
+// SHM_OPENED_GRID_COUNT, i.e. the number of opened grids (entries, with runs)
+// in the last chunk if there are several chunks, or -1 (mine) / -2 / -3
+// (skipped, see the memory layout)
+int serve_click(
+	long click_r, long click_c,
+	bool skip_when_reopen, bool do_not_expand, bool new_only,
+	ReplyWriter &writer
+) {
+	if (do_not_expand) {
+		set_is_open(click_r, click_c);
+		if (test_is_mine(click_r, click_c)) {
+			return -1;
+		} else {
+			writer.append(click_r, click_c, get_adj_mine(click_r, click_c));
+			return writer.count;
+		}
+	} else if (skip_when_reopen && test_is_open(click_r, click_c)) {
+		// This grid has been opened before, and the player's program says
+		// that "If the grid has been opened before, plz skip it"
+		// So we just return -2 (non-mine) or -3 (is-mine)
+		return test_is_mine(click_r, click_c) ? -3 : -2;
+	} else {
+		if (test_is_mine(click_r, click_c)) {
+			// This grid contains a mine, BOOM SHAKALAKA!
+			set_is_open(click_r, click_c);
+			return -1;
+		} else if (get_adj_mine(click_r, click_c)) {
+			// This grid contains a non-zero number
+			set_is_open(click_r, click_c);
+			writer.append(click_r, click_c, get_adj_mine(click_r, click_c));
+			return writer.count;
+		} else {
+			// This grid contains zero
+			if (use_zero_comps) {
+				long id = zero_comp_id[(click_r<<logN) + click_c] - 1;
+				long start = zero_comp_start[id], count = zero_comp_start[id+1] - start;
+				if (new_only) {
+					for (long i = start; i < start+count; ++i) {
+						if (set_is_open(zero_comp_grids[i][0], zero_comp_grids[i][1])) {
+							writer.append(zero_comp_grids[i][0], zero_comp_grids[i][1], zero_comp_grids[i][2]);
+						}
+					}
+					return writer.count;
+				}
+				if (count <= MAX_OPEN_GRID && !writer.runs) {
+					// Open the grids before copying them, so the revealed board
+					// and the open bitmap never lag behind a reply
+					for (long i = start; i < start+count; ++i) {
+						set_is_open(zero_comp_grids[i][0], zero_comp_grids[i][1]);
+					}
+					memcpy(writer.arr, zero_comp_grids+start, count*sizeof(*zero_comp_grids));
+					writer.count = writer.num_grids = count;
+				} else {
+					// Too large for a single chunk, or to be put into runs. Here
+					// `append()` may publish a chunk, so open each grid first
+					for (long i = start; i < start+count; ++i) {
+						set_is_open(zero_comp_grids[i][0], zero_comp_grids[i][1]);
+						writer.append(zero_comp_grids[i][0], zero_comp_grids[i][1], zero_comp_grids[i][2]);
+					}
+				}
+				return writer.count;
+			}
+			// BFS is needed
+			long start_ns = collect_stats ? get_time_ns() : 0;
+			if (use_bitwise_bfs) {
+				worker_thread_flood(click_r, click_c, new_only, writer);
+			} else {
+				worker_thread_bfs(click_r, click_c, new_only, writer);
+			}
+			if (collect_stats) {
+				my_worker_stats->num_bfs += 1;
+				my_worker_stats->num_bfs_grids += writer.total();
+				my_worker_stats->bfs_ns += get_time_ns() - start_ns;
+			}
+			return writer.count;
+		}
+	}
+}
+
+// SyncReply - The context of a `ReplyWriter` for a (non-asynchronous) channel
+struct SyncReply {
+	char* shm_pos;
+	unsigned int seq;	// The sequence number of the request
+	int batch_index;	// The index of the click in the batch, or -1 for a single click
+};
+
+/*
+ * Parked replies
+ *	A thread in the pool serves many channels, so it does not wait for the
+ * player's program to consume a chunk (see `wait_for_chunk_ack()`). Instead,
+ * the chunks it cannot publish yet are kept in the `ParkedReply` of the
+ * channel, and published by `resume_parked_reply()`, right after the request
+ * or when the player's program consumes a chunk and rings the doorbell (see
+ * SHM_CHUNK_PARKED_BIT).
+ *	The kept chunks are bounded per channel by `parked_max_chunks`
+ * (MINESWEEPER_GS_PARKED_CHUNKS, 64 by default, i.e. about 6 MB and a million
+ * grids). A reply cannot be put aside in the middle of an expansion, so a
+ * thread reaching the limit does wait for the player's program after all
+ * (see `drain_parked_reply()`), and the pool has one thread less until the
+ * player's program calls `next_chunk()`. A player's program which leaves
+ * such huge replies unread on as many channels as there are threads in the
+ * pool stalls the pool, but all the channels it stalls are its own.
+ */
+struct ParkedReply {
+	unsigned short (*chunks)[MAX_OPEN_GRID][3];	// The kept chunks
+	long* counts;	// The number of entries in each kept chunk
+	long capacity;
+	long num_chunks;	// The number of kept chunks, 0 if nothing is kept
+	long num_published;	// The number of kept chunks published
+	long first_chunk;	// The index of chunks[0] in the reply
+};
+ParkedReply parked_replies[MAX_CHANNEL];
+thread_local ParkedReply* my_parked_reply;	// Set by threads in the pool only
+thread_local bool my_reply_is_parked;	// Whether the last request left chunks in `my_parked_reply`
+
+// wait_for_chunk_ack - Wait until the player's program has consumed
+// `num_chunks` chunks, with the "two-phase lock"
+void wait_for_chunk_ack(char* shm_pos, unsigned int num_chunks) {
+	for (int i = 0; i < TWO_PHASE_LOCK_SPIN_AMUONT; ++i) {
+		if (SHM_CHUNK_ACK(shm_pos) >= num_chunks) {
+			return;
+		}
+		cpu_relax();
+	}
+	// Both are SEQ_CST so that either we see the new ACK, or the player's
+	// program sees the sleeping bit (see `Channel::next_chunk()`)
+	__atomic_store_n(&SHM_CHUNK_SLEEPING_BIT(shm_pos), 1, __ATOMIC_SEQ_CST);
+	unsigned int ack;
+	while ((ack = __atomic_load_n(SHM_CHUNK_ACK_PTR(shm_pos), __ATOMIC_SEQ_CST)) < num_chunks) {
+		futex_wait(SHM_CHUNK_ACK_PTR(shm_pos), ack);
+	}
+	SHM_CHUNK_SLEEPING_BIT(shm_pos) = 0;
+}
+
+// publish_done - Tell the player's program that the request `seq` is done, and
+// wake it up if it is sleeping
+//	Both are SEQ_CST, so that either we see the waiting bit, or the player's
+// program sees the new sequence number before it goes to sleep (see
+// `submit_and_wait()` in minesweeper_helpers.cpp)
+void publish_done(char* shm_pos, unsigned int seq) {
+	__atomic_store_n(SHM_DONE_SEQ_PTR(shm_pos), seq, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&SHM_CLIENT_WAITING_BIT(shm_pos), __ATOMIC_SEQ_CST)) {
+		futex_wake(SHM_DONE_SEQ_PTR(shm_pos));
+		my_worker_stats->num_client_wakes += 1;
+	}
+}
+
+// publish_later_chunk - Publish the k-th chunk (k > 0) of `count` entries,
+// which is in SHM_CHUNK_ARR(shm_pos, k), and wake up the player's program if
+// it is sleeping. Both are SEQ_CST, same as `publish_done()`
+void publish_later_chunk(char* shm_pos, long k, long count, bool more) {
+	SHM_CHUNK_COUNT(shm_pos, k) = count;
+	SHM_CHUNK_MORE(shm_pos, k) = more;
+	__atomic_store_n(SHM_CHUNK_READY_PTR(shm_pos), k+1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&SHM_CHUNK_WAITING_BIT(shm_pos), __ATOMIC_SEQ_CST)) {
+		futex_wake(SHM_CHUNK_READY_PTR(shm_pos));
+		my_worker_stats->num_client_wakes += 1;
+	}
+}
+
+// publish_sync_chunk - Publish the current chunk of `writer` to the player's
+// program. `more` tells whether there are more chunks after it
+//	The 0-th chunk is published like a normal reply, i.e. by setting the done
+// bit, while the others are published by SHM_CHUNK_READY
+void publish_sync_chunk(ReplyWriter &writer, bool more) {
+	SyncReply* reply = (SyncReply*)writer.ctx;
+	char* shm_pos = reply->shm_pos;
+	long k = writer.num_chunks;
+	if (my_reply_is_parked) {
+		// The chunk is kept (see `park_chunk()`)
+		my_parked_reply->counts[my_parked_reply->num_chunks-1] = writer.count;
+		return;
+	}
+	if (k == 0) {
+		SHM_CHUNK_READY(shm_pos) = 1;
+		SHM_CHUNK_ACK(shm_pos) = 0;
+		SHM_CHUNK_MORE(shm_pos, 0) = more;
+		if (reply->batch_index < 0) {
+			SHM_OPENED_GRID_COUNT(shm_pos) = writer.count;
+		} else {
+			(*SHM_BATCH_RESULT_ARR(shm_pos))[reply->batch_index][0] = writer.count;
+			(*SHM_BATCH_RESULT_ARR(shm_pos))[reply->batch_index][1] = 0;
+			SHM_OPENED_GRID_COUNT(shm_pos) = reply->batch_index+1;
+		}
+		publish_done(shm_pos, reply->seq);
+	} else {
+		publish_later_chunk(shm_pos, k, writer.count, more);
+	}
+}
+
+// publish_kept_chunk - Copy the next kept chunk of `parked` into the shm
+// region, and publish it. The caller has made sure that the buffer is free
+//	Once the last chunk is published, the player's program may send another
+// request, so `parked` is reset before that
+void publish_kept_chunk(char* shm_pos, ParkedReply &parked, bool more) {
+	long i = parked.num_published++;
+	long k = parked.first_chunk + i;
+	long count = parked.counts[i];
+	memcpy(*SHM_CHUNK_ARR(shm_pos, k), parked.chunks[i], count*sizeof(parked.chunks[i][0]));
+	if (parked.num_published == parked.num_chunks) {
+		parked.num_chunks = 0;
+	}
+	publish_later_chunk(shm_pos, k, count, more);
+}
+
+// drain_parked_reply - Publish all the kept chunks of `parked`, waiting for
+// the player's program when needed. More chunks follow them
+void drain_parked_reply(char* shm_pos, ParkedReply &parked) {
+	while (parked.num_chunks) {
+		wait_for_chunk_ack(shm_pos, parked.first_chunk + parked.num_published - 1);
+		publish_kept_chunk(shm_pos, parked, true);
+	}
+	my_reply_is_parked = false;
+}
+
+// park_chunk - Let `writer` put the next chunk into `parked` instead of the
+// shm region
+void park_chunk(ParkedReply &parked, ReplyWriter &writer) {
+	if (parked.num_chunks == 0) {
+		parked.first_chunk = writer.num_chunks;
+		parked.num_published = 0;
+		my_reply_is_parked = true;
+	}
+	if (parked.num_chunks == parked.capacity) {
+		parked.capacity = max(parked.capacity*2, 4L);
+		int oldstate = Defer_cancel();
+		parked.chunks = (unsigned short (*)[MAX_OPEN_GRID][3])Realloc(parked.chunks, parked.capacity*sizeof(parked.chunks[0]));
+		parked.counts = (long*)Realloc(parked.counts, parked.capacity*sizeof(long));
+		Restore_cancel(oldstate);
+	}
+	writer.arr = parked.chunks[parked.num_chunks++];
+}
+
+// resume_parked_reply - Publish the kept chunks of `parked` as far as the
+// player's program allows. If some are left, park the reply (again)
+//	Setting SHM_CHUNK_PARKED_BIT and loading SHM_CHUNK_ACK are both SEQ_CST,
+// and the player's program does the opposite (see `Channel::next_chunk()`), so
+// either we see the new ACK, or it sees the bit. The one who takes the bit
+// back (by `__atomic_exchange_n`) goes on with the reply: if it is the player's
+// program, it rings the doorbell, and a thread in the pool calls us again
+void resume_parked_reply(char* shm_pos, ParkedReply &parked) {
+	while (true) {
+		long k = parked.first_chunk + parked.num_published;
+		while (__atomic_load_n(SHM_CHUNK_ACK_PTR(shm_pos), __ATOMIC_SEQ_CST) >= k-1) {
+			bool last = parked.num_published+1 == parked.num_chunks;
+			publish_kept_chunk(shm_pos, parked, !last);
+			if (last) {
+				// Do not touch `parked` anymore, see `publish_kept_chunk()`
+				return;
+			}
+			k += 1;
+		}
+		__atomic_store_n(&SHM_CHUNK_PARKED_BIT(shm_pos), 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(SHM_CHUNK_ACK_PTR(shm_pos), __ATOMIC_SEQ_CST) < k-1
+			|| !__atomic_exchange_n(&SHM_CHUNK_PARKED_BIT(shm_pos), 0, __ATOMIC_SEQ_CST)) {
+			return;
+		}
+	}
+}
+
+// flush_sync_chunk - `ReplyWriter::flush` for a (non-asynchronous) channel
+// The k-th chunk is put into SHM_CHUNK_ARR(shm_pos, k), so before moving on
+// to the buffer of the (k+1)-th chunk, we wait for the player's program to
+// consume the (k-1)-th chunk, which is in the same buffer
+void flush_sync_chunk(ReplyWriter &writer) {
+	char* shm_pos = ((SyncReply*)writer.ctx)->shm_pos;
+	publish_sync_chunk(writer, true);
+	writer.num_chunks += 1;
+	ParkedReply* parked = my_parked_reply;
+	if (parked && parked->num_chunks == parked_max_chunks) {
+		drain_parked_reply(shm_pos, *parked);
+	}
+	if (parked && (parked->num_chunks
+		|| (writer.num_chunks >= 2 && SHM_CHUNK_ACK(shm_pos) < writer.num_chunks-1))) {
+		// A thread in the pool keeps the chunk instead of waiting
+		park_chunk(*parked, writer);
+	} else {
+		if (writer.num_chunks >= 2) {
+			wait_for_chunk_ack(shm_pos, writer.num_chunks-1);
+		}
+		writer.arr = *SHM_CHUNK_ARR(shm_pos, writer.num_chunks);
+	}
+	writer.count = 0;
+	writer.run = -1;
+}
+
+// serve_batch - Serve a `click_batch()` request with `batch_size` clicks
+// Results of all clicks are put into SHM_OPENED_GRID_ARR one after another.
+// Since a click with expansion may open up to MAX_OPEN_GRID grids, it is
+// only served when nothing has been put into SHM_OPENED_GRID_ARR yet.
+// Otherwise we stop there, and the player's program will re-submit the rest.
+// If such a click opens more than MAX_OPEN_GRID grids, its result is
+// streamed (which publishes the reply, so `streamed` is set to true), and the
+// batch stops after it as well.
+// Returns the number of served clicks
+int serve_batch(char* shm_pos, unsigned int seq, int batch_size, bool &streamed) {
+	unsigned short (*request_arr)[3] = *SHM_BATCH_REQUEST_ARR(shm_pos);
+	int (*batch_result_arr)[2] = *SHM_BATCH_RESULT_ARR(shm_pos);
+	unsigned short (*result_arr)[3] = *SHM_OPENED_GRID_ARR(shm_pos);
+	batch_size = min(batch_size, MAX_BATCH_SIZE);
+	long used = 0;	// The number of elements used in SHM_OPENED_GRID_ARR
+	streamed = false;
+	int i;
+	for (i = 0; i < batch_size; ++i) {
+		long click_r = request_arr[i][0];
+		long click_c = request_arr[i][1];
+		int flags = request_arr[i][2];
+		bool do_not_expand = flags & SHM_CLICK_FLAG_DO_NOT_EXPAND;
+		long one_grid = flags & SHM_CLICK_FLAG_RUNS ? 2 : 1;	// The entries taken by a grid
+		if (do_not_expand ? used + one_grid > MAX_OPEN_GRID : used != 0) {
+			break;
+		}
+		SyncReply reply = {shm_pos, seq, i};
+		ReplyWriter writer = {
+			result_arr + used, 0, 0, flush_sync_chunk, &reply,
+			(bool)(flags & SHM_CLICK_FLAG_RUNS)};
+		int count = serve_click(
+			click_r, click_c,
+			flags & SHM_CLICK_FLAG_SKIP_WHEN_REOPEN, do_not_expand,
+			flags & SHM_CLICK_FLAG_NEW_ONLY, writer);
+		if (writer.num_chunks) {
+			publish_sync_chunk(writer, false);
+			streamed = true;
+			return i+1;
+		}
+		batch_result_arr[i][0] = count;
+		batch_result_arr[i][1] = used;
+		used += max(count, 0);
+	}
+	return i;
+}
+
+/*
+ * Rectangle requests
+ *	Sweeping an area with `click_do_not_expand()` costs a round trip per grid.
+ * `Channel::click_rect()` opens a whole rectangle in one request instead (see
+ * "Rectangle requests" in `shm.h`). Every row of it is handled a word (64
+ * grids) at a time: the mines come from the map file by `load_mine_word()`,
+ * the non-mine grids are opened by a single `set_is_open_word()`, and only
+ * the mines, which are rare, are opened one by one.
+ */
+
+// put_rect_code - Put `code` as the `index`-th grid of `tile`. Grids are put
+// in order, so the even ones clear their bytes
+inline void put_rect_code(unsigned char* tile, long index, unsigned char code) {
+	if (index%2) {
+		tile[index/2] |= code<<4;
+	} else {
+		tile[index/2] = code;
+	}
+}
+
+// serve_rect - Serve a `click_rect()` request of the rectangle of `h` rows and
+// `w` columns at (r0, c0). The tile is put into SHM_OPENED_GRID_ARR, and the
+// counts into `num_mines` and `num_new`
+void serve_rect(char* shm_pos, long r0, long c0, long h, long w, long &num_mines, long &num_new) {
+	unsigned char* tile = (unsigned char*)SHM_OPENED_GRID_ARR(shm_pos);
+	num_mines = num_new = 0;
+	for (long i = 0; i < h; ++i) {
+		long r = r0+i;
+		if (N < 64) {
+			// A word would cross rows
+			for (long c = c0; c < c0+w; ++c) {
+				bool mine = test_is_mine(r, c);
+				num_mines += mine;
+				num_new += set_is_open(r, c);
+				put_rect_code(tile, i*w + c-c0, mine ? SHM_RECT_CODE_MINE : get_adj_mine(r, c));
+			}
+			continue;
+		}
+		for (long c = c0; c < c0+w; ) {
+			long wc = c/64, base = wc*64, end = min(c0+w, base+64);
+			uint64_t mask = (end-base == 64 ? ~0UL : (1UL<<(end-base))-1) & ~((1UL<<(c-base))-1);
+			uint64_t mines = load_mine_word(r, wc) & mask;
+			num_new += __builtin_popcountl(set_is_open_word(r, wc, mask & ~mines));
+			num_mines += __builtin_popcountl(mines);
+			for (uint64_t bits = mines; bits; bits &= bits-1) {
+				num_new += set_is_open(r, base + __builtin_ctzl(bits));
+			}
+			for (; c < end; ++c) {
+				put_rect_code(tile, i*w + c-c0,
+					mines>>(c-base)&0x1 ? SHM_RECT_CODE_MINE : get_adj_mine(r, c));
+			}
+		}
+	}
+}
+
+// serve_request - Serve the pending request of a (non-asynchronous) channel,
+// and tell the player's program that it is done by setting SHM_DONE_SEQ to
+// the sequence number of the request, which is returned
+// `closed` tells whether the request closes the channel, in which case the
+// caller releases the channel afterwards (see `release_channel_id()`). Do not
+// check SHM_CLOSE_STATE after this returns: the player's program may have
+// submitted the closing request right after this one
+unsigned int serve_request(char* shm_pos, bool &closed) {
+	unsigned int seq = __atomic_load_n(SHM_REQUEST_SEQ_PTR(shm_pos), __ATOMIC_ACQUIRE);
+	closed = SHM_CLOSE_STATE(shm_pos) == SHM_CLOSE_REQUESTED;
+	if (closed) {
+		// The channel is being closed, there is nothing to serve
+		publish_done(shm_pos, seq);
+		return seq;
+	}
+	// If the reply is streamed, it has been published chunk by chunk
+	SHM_CHUNK_MORE(shm_pos, 0) = 0;
+	int batch_size = SHM_BATCH_SIZE(shm_pos);
+	if (batch_size) {
+		bool streamed;
+		int num_served = serve_batch(shm_pos, seq, batch_size, streamed);
+		if (streamed) return seq;
+		SHM_OPENED_GRID_COUNT(shm_pos) = num_served;
+	} else if (SHM_RECT_H(shm_pos)) {
+		long h = SHM_RECT_H(shm_pos), w = SHM_RECT_W(shm_pos);
+		long num_mines, num_new;
+		serve_rect(shm_pos, SHM_CLICK_R(shm_pos), SHM_CLICK_C(shm_pos), h, w, num_mines, num_new);
+		SHM_RECT_NUM_MINES(shm_pos) = num_mines;
+		SHM_RECT_NUM_NEW(shm_pos) = num_new;
+		SHM_OPENED_GRID_COUNT(shm_pos) = h*w;
+	} else {
+		SyncReply reply = {shm_pos, seq, -1};
+		ReplyWriter writer = {
+			*SHM_OPENED_GRID_ARR(shm_pos), 0, 0, flush_sync_chunk, &reply,
+			(bool)SHM_RUNS_BIT(shm_pos)};
+		int count = serve_click(
+			SHM_CLICK_R(shm_pos), SHM_CLICK_C(shm_pos),
+			SHM_SKIP_WHEN_REOPEN_BIT(shm_pos), SHM_DO_NOT_EXPAND_BIT(shm_pos),
+			SHM_NEW_ONLY_BIT(shm_pos), writer);
+		if (writer.num_chunks) {
+			publish_sync_chunk(writer, false);
+			return seq;
+		}
+		SHM_OPENED_GRID_COUNT(shm_pos) = count;
+	}
+
+	// Done
+	publish_done(shm_pos, seq);
+	return seq;
+}
+
+// register_worker_thread - Register the calling worker thread (including
+// threads in the pool), and make it cancellable
+//	Worker threads are cancelled asynchronously, so they wrap malloc() and
+// locked mutexes in `Defer_cancel()`. Otherwise a thread could be cancelled
+// while holding the malloc lock, and `summarize()` would deadlock on it.
+void register_worker_thread() {
 	Pthread_mutex_lock(&worker_thread_tids_mutex);
+	if (worker_threads_killed) {
+		Pthread_mutex_unlock(&worker_thread_tids_mutex);
+		Pthread_exit(NULL);
+	}
 	// Make the thread cancellable
 	Pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	Pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 	worker_thread_tids.push_back(Pthread_self());
 	Pthread_mutex_unlock(&worker_thread_tids_mutex);
+}
+
+// reclaim_closing_channel_ids - Move the IDs of closed channels, which the
+// player's program has left, into the free list. Called with
+// `free_channel_ids_mutex` held
+void reclaim_closing_channel_ids() {
+	for (size_t i = 0; i < closing_channel_ids.size(); ) {
+		int channel_id = closing_channel_ids[i];
+		char* shm_pos = shm_start + CHANNEL_SHM_SIZE*channel_id;
+		if (__atomic_load_n(&SHM_CLOSE_STATE(shm_pos), __ATOMIC_ACQUIRE) == SHM_CLOSE_LEFT) {
+			free_channel_ids.push_back(channel_id);
+			closing_channel_ids[i] = closing_channel_ids.back();
+			closing_channel_ids.pop_back();
+		} else {
+			++i;
+		}
+	}
+}
 
-	// Create a new channel
+// allocate_channel_id - Allocate a channel ID, reusing the ID of a closed
+// channel if there is one
+int allocate_channel_id() {
+	Pthread_mutex_lock(&free_channel_ids_mutex);
+	while (true) {
+		reclaim_closing_channel_ids();
+		if (!free_channel_ids.empty()) {
+			int channel_id = free_channel_ids.back();
+			free_channel_ids.pop_back();
+			Pthread_mutex_unlock(&free_channel_ids_mutex);
+			return channel_id;
+		}
+		if (closing_channel_ids.empty() || next_channel_id.load() < MAX_CHANNEL) break;
+		// All IDs are taken, but some channels are being closed. The player's
+		// program leaves them right after the completion
+		Pthread_mutex_unlock(&free_channel_ids_mutex);
+		sched_yield();
+		Pthread_mutex_lock(&free_channel_ids_mutex);
+	}
+	Pthread_mutex_unlock(&free_channel_ids_mutex);
 	int channel_id = next_channel_id.fetch_add(1);
 	if (channel_id >= MAX_CHANNEL) {
 		char buf[128];
@@ -356,95 +2174,549 @@ void* worker_thread_routine(void* arg) {
 		report_error_to_judger(buf);
 		kill_worker_threads();
 		exit(0);
-		return NULL;
 	}
-	char* shm_pos = shm_start + CHANNEL_SHM_SIZE*channel_id;
-	init_shm_region(shm_pos);
+	return channel_id;
+}
+
+// release_channel_id - Release the ID of a closed channel
+// This should be called after the last completion of the channel is published.
+// The shm region is reinitialized once the ID is reused, so the ID only goes
+// into the free list after the player's program leaves the region (see
+// SHM_CLOSE_STATE), which is checked by `allocate_channel_id()`. The calling
+// thread does not wait for it
+void release_channel_id(int channel_id) {
+	int oldstate = Defer_cancel();
+	Pthread_mutex_lock(&free_channel_ids_mutex);
+	closing_channel_ids.push_back(channel_id);
+	Pthread_mutex_unlock(&free_channel_ids_mutex);
+	Restore_cancel(oldstate);
+}
+
+thread_local bool is_bound;	// Whether the calling worker thread is bound to a core
 
-	// Response to player's program with the channel ID (through fd_to_pl)
+// bind_worker_thread - Bind the calling worker thread to the partner core of
+// the core pair `core_pair` (see `core_pairs`), if there is one. Otherwise a
+// worker thread bound for an earlier channel is unbound
+void bind_worker_thread(long core_pair) {
+	if (core_pair >= 0 && core_pair < num_core_pairs) {
+		bind_thread_to_core(core_pairs[core_pair].server_core);
+		is_bound = true;
+	} else if (is_bound) {
+		unbind_thread();
+		is_bound = false;
+	}
+}
+
+// reply_channel_id - Response to player's program with the channel ID (through fd_to_pl)
+// This should be called after the shm region of the channel is initialized
+void reply_channel_id(int channel_id) {
 	char buf[16];
 	sprintf(buf, "%d", channel_id);
 	Write(fd_to_pl, buf, strlen(buf)+1);
+}
+
+/*
+ * Adaptive two phase lock
+ *	A fixed spin amount is too short for a bursty channel (it falls into
+ * `futex_wait` between two requests of a burst, and pays for a wake-up every
+ * time), and too long for an idle one (it burns CPU cycles which the player's
+ * threads could use). So each waiting thread keeps a `SpinPolicy`, an
+ * estimate of how long it usually waits for the next request (an exponential
+ * moving average, with weight 1/SPIN_AVG_WEIGHT for the latest wait), and
+ * spins for about twice that long. If the estimate is longer than
+ * MAX_SPIN_NS, spinning is unlikely to help, so we go to sleep at once.
+ *	Spinning does not help either when the player's program cannot run while
+ * we spin (e.g. both of them share a CPU core), and then the waits measured
+ * are misleading. So every spin which ends up sleeping halves the spin budget,
+ * until it is shorter than MIN_SPIN_NS, which means no spinning at all. A
+ * request caught while spinning restores the budget. Once it is down to
+ * nothing, we still spin with the full budget once in a while, in case things
+ * have changed. Since such a probe is expensive when it fails, the interval
+ * between two probes starts from MIN_SPIN_PROBE_INTERVAL waits, and doubles
+ * after every failed probe, up to MAX_SPIN_PROBE_INTERVAL waits.
+ *	While spinning, we poll with exponential backoff (1, 2, 4, ...,
+ * MAX_SPIN_BACKOFF `pause`s between two polls), so a hyperthread sibling and
+ * the cache line of the channel are not hammered.
+ *	A channel whose last HOT_STREAK_FOR_PURE_SPIN requests were all caught
+ * while spinning is "hot", and its thread stays in the pure spin mode: it
+ * does not sleep until the channel has been idle for PURE_SPIN_MAX_IDLE_NS.
+ */
+constexpr long MIN_SPIN_NS = 1000;
+constexpr long MAX_SPIN_NS = 100000;
+constexpr long INITIAL_SPIN_AVG_NS = 10000;
+constexpr long SPIN_AVG_WEIGHT = 8;
+constexpr int MAX_SPIN_MISS_SHIFT = 8;
+constexpr long MIN_SPIN_PROBE_INTERVAL = 1024;
+constexpr long MAX_SPIN_PROBE_INTERVAL = 1L<<20;
+constexpr int MAX_SPIN_BACKOFF = 16;
+constexpr long HOT_STREAK_FOR_PURE_SPIN = 1024;
+constexpr long PURE_SPIN_MAX_IDLE_NS = 10000000;
+
+// SpinPolicy - The state of the adaptive two phase lock of a waiting thread
+struct SpinPolicy {
+	long avg_wait_ns = INITIAL_SPIN_AVG_NS;	// The estimated waiting time
+	int miss_shift = 0;	// The spin budget is halved this many times
+	long hot_streak = 0;	// The number of requests caught while spinning in a row
+	long probe_interval = MIN_SPIN_PROBE_INTERVAL;
+	long waits_to_probe = MIN_SPIN_PROBE_INTERVAL;
+	bool last_wait_pure_spin = false;	// Whether the last wait started in pure spin mode
+
+	// is_pure_spin - Whether the next wait is in pure spin mode
+	bool is_pure_spin() const {
+		return hot_streak >= HOT_STREAK_FOR_PURE_SPIN;
+	}
+	// spin_limit_ns - How long we should spin before going to sleep
+	long spin_limit_ns() const {
+		if (is_pure_spin()) return PURE_SPIN_MAX_IDLE_NS;
+		if (avg_wait_ns > MAX_SPIN_NS) return 0;
+		long limit = max(MIN_SPIN_NS, min(MAX_SPIN_NS, avg_wait_ns*2));
+		if (waits_to_probe > 0) {
+			limit >>= miss_shift;
+		}
+		return limit >= MIN_SPIN_NS ? limit : 0;
+	}
+	// update - Record a wait of `wait_ns` nanoseconds after spinning for
+	// `limit_ns` nanoseconds at most. `hit` tells whether the request is caught
+	// while spinning
+	void update(long wait_ns, long limit_ns, bool hit) {
+		// A long sleep says nothing more than "spinning does not help", so
+		// we clip it to recover quickly when the channel gets busy again
+		wait_ns = min(wait_ns, MAX_SPIN_NS*2);
+		avg_wait_ns += (wait_ns - avg_wait_ns)/SPIN_AVG_WEIGHT;
+		if (hit) {
+			miss_shift = 0;
+			probe_interval = MIN_SPIN_PROBE_INTERVAL;
+		} else if (limit_ns) {
+			miss_shift = min(miss_shift+1, MAX_SPIN_MISS_SHIFT);
+		}
+		if (--waits_to_probe < 0) {
+			// It was a probe
+			if (!hit) {
+				probe_interval = min(probe_interval*2, MAX_SPIN_PROBE_INTERVAL);
+			}
+			waits_to_probe = probe_interval;
+		}
+		hot_streak = hit ? hot_streak+1 : 0;
+	}
+};
 
+// two_phase_wait - Wait for a request with the adaptive two phase lock
+// `poll()` returns whether there is a request. `sleep()` does the second
+// phase: it returns only when there is a request, and may call `futex_wait`.
+// Returns whether the request is caught while spinning
+template <class Poll, class Sleep>
+bool two_phase_wait(SpinPolicy &policy, Poll poll, Sleep sleep) {
+	long start_ns = get_time_ns();
+	policy.last_wait_pure_spin = policy.is_pure_spin();
+	long limit_ns = policy.spin_limit_ns();
+	long now_ns = start_ns;
+	bool hit = false;
+	for (int backoff = 1; ; backoff = min(backoff*2, MAX_SPIN_BACKOFF)) {
+		if (poll()) {
+			hit = true;
+			break;
+		}
+		for (int i = 0; i < backoff; ++i) {
+			cpu_relax();
+		}
+		now_ns = get_time_ns();
+		if (now_ns - start_ns > limit_ns) break;
+	}
+	if (!hit) {
+		sleep();
+		now_ns = get_time_ns();
+	}
+	policy.update(now_ns - start_ns, limit_ns, hit);
+	return hit;
+}
+
+// count_wait - Count a wait of `two_phase_wait()` in the stats of the
+// current channel
+inline void count_wait(const SpinPolicy &policy, bool hit) {
+	if (hit) {
+		my_worker_stats->num_spin_hits += 1;
+		if (policy.last_wait_pure_spin) {
+			my_worker_stats->num_pure_spin_waits += 1;
+		}
+	} else {
+		my_worker_stats->num_futex_sleeps += 1;
+	}
+}
+
+// serve_sync_channel - Serve the requests of a channel, whose shm region
+// starts at `shm_pos`, with the calling worker thread, until it is closed
+void serve_sync_channel(char* shm_pos) {
 	// printf("is_mine %d\n", test_is_mine(1, 1));
 	// Go to 996!
+	SpinPolicy policy;
+	unsigned int served_seq = 0;	// The sequence number of the last served request
 	while (true) {
 		// The two phase lock
-		// First we spin for a while
-		bool flag = false;
-		for (int i = 0; i < TWO_PHASE_LOCK_SPIN_AMUONT; ++i) {
-			if (SHM_PENDING_BIT(shm_pos)) {
-				flag = true;
-				break;
-			}
-		}
-		// If we still cannot grab the lock, we use `futex`
-		if (!flag) {
-			SHM_SLEEPING_BIT(shm_pos) = 1;
-			while (true) {
-				if (SHM_PENDING_BIT(shm_pos) == 1) {
-					break;
+		// First we spin for a while. If we still cannot grab the lock, we use `futex`
+		bool hit = two_phase_wait(policy,
+			[&]() { return __atomic_load_n(SHM_REQUEST_SEQ_PTR(shm_pos), __ATOMIC_ACQUIRE) != served_seq; },
+			[&]() {
+				// Both are SEQ_CST, so that either we see the new request, or the
+				// player's program sees the sleeping bit
+				__atomic_store_n(&SHM_SLEEPING_BIT(shm_pos), 1, __ATOMIC_SEQ_CST);
+				while (__atomic_load_n(SHM_REQUEST_SEQ_PTR(shm_pos), __ATOMIC_SEQ_CST) == served_seq) {
+					futex_wait(SHM_REQUEST_SEQ_PTR(shm_pos), served_seq);
 				}
-				futex_wait(SHM_PENDING_BIT_PTR(shm_pos), 0);
+				__atomic_store_n(&SHM_SLEEPING_BIT(shm_pos), 0, __ATOMIC_RELAXED);
+			});
+		count_wait(policy, hit);
+		// I'm wake up
+		// There is a new request
+		bool closed;
+		served_seq = serve_request(shm_pos, closed);
+		if (closed) {
+			return;
+		}
+	}
+}
+
+
+// AsyncReply - The state of the completion ring and the arena of an
+// asynchronous channel, which is also the context of its `ReplyWriter`
+struct AsyncReply {
+	char* shm_pos;
+	unsigned int cq_tail;
+	unsigned long arena_pos;
+	unsigned int tag;	// The tag of the click being served
+	SpinPolicy arena_policy;	// For waiting on ASYNC_ARENA_RELEASED
+};
+
+// reserve_async_arena - Make sure there is room for `need` grids at
+// `reply.arena_pos`, by waiting for the player's program to release the arena
+//	Same as waiting for requests, we spin for a while and then sleep on the low
+// 32 bits of ASYNC_ARENA_RELEASED (the arena is far smaller than 2^32 grids, so
+// they always change on a release). ASYNC_ARENA_SLEEPING_BIT is set before the
+// last load, and the player's program loads it after storing the new position
+// (all SEQ_CST), so the wakeup is never lost.
+void reserve_async_arena(AsyncReply &reply, long need) {
+	if (reply.arena_pos%ASYNC_ARENA_SIZE + need > ASYNC_ARENA_SIZE) {
+		// Results are not allowed to wrap around
+		reply.arena_pos += ASYNC_ARENA_SIZE - reply.arena_pos%ASYNC_ARENA_SIZE;
+	}
+	char* shm_pos = reply.shm_pos;
+	auto has_room = [&]() {
+		return reply.arena_pos + need - __atomic_load_n(&ASYNC_ARENA_RELEASED(shm_pos), __ATOMIC_ACQUIRE) <= ASYNC_ARENA_SIZE;
+	};
+	if (has_room()) {
+		return;
+	}
+	two_phase_wait(reply.arena_policy, has_room, [&]() {
+		__atomic_store_n(&ASYNC_ARENA_SLEEPING_BIT(shm_pos), 1, __ATOMIC_SEQ_CST);
+		unsigned long released;
+		while (reply.arena_pos + need - (released = __atomic_load_n(&ASYNC_ARENA_RELEASED(shm_pos), __ATOMIC_SEQ_CST)) > ASYNC_ARENA_SIZE) {
+			futex_wait(ASYNC_ARENA_RELEASED_PTR(shm_pos), (unsigned int)released);
+		}
+		__atomic_store_n(&ASYNC_ARENA_SLEEPING_BIT(shm_pos), 0, __ATOMIC_RELAXED);
+	});
+}
+
+// publish_async_completion - Put a completion of `count` grids at
+// `reply.arena_pos` into the completion ring, and wake up the player's program
+// if it is sleeping in `AsyncChannel::wait()` (both SEQ_CST, see `publish_done()`)
+void publish_async_completion(AsyncReply &reply, int count, unsigned int flags) {
+	ASYNC_CQ_ARR(reply.shm_pos)[reply.cq_tail%ASYNC_CQ_RING_SIZE] = {reply.tag, count, reply.arena_pos, flags};
+	reply.arena_pos += max(count, 0);
+	reply.cq_tail += 1;
+	__atomic_store_n(&ASYNC_CQ_TAIL(reply.shm_pos), reply.cq_tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ASYNC_CLIENT_WAITING_BIT(reply.shm_pos), __ATOMIC_SEQ_CST)) {
+		futex_wake(&ASYNC_CQ_TAIL(reply.shm_pos));
+	}
+}
+
+// flush_async_chunk - `ReplyWriter::flush` for an asynchronous channel
+// Every chunk is a completion with the same tag
+void flush_async_chunk(ReplyWriter &writer) {
+	AsyncReply* reply = (AsyncReply*)writer.ctx;
+	publish_async_completion(*reply, writer.count,
+		ASYNC_COMPLETION_FLAG_MORE | (writer.runs ? ASYNC_COMPLETION_FLAG_RUNS : 0));
+	writer.num_chunks += 1;
+	reserve_async_arena(*reply, MAX_OPEN_GRID);
+	writer.arr = ASYNC_ARENA(reply->shm_pos) + reply->arena_pos%ASYNC_ARENA_SIZE;
+	writer.count = 0;
+	writer.run = -1;
+}
+
+// serve_async_channel - Serve the requests of an asynchronous channel with
+// the calling worker thread, until it is closed
+//	It drains the submission ring continuously, and puts the results into the
+// completion ring in the order of submission. Results are put into the arena
+// one after another. Before serving a request, we make sure that there is
+// enough room in the arena (1 grid, i.e. 1 entry or a run of 2 entries, for a
+// click without expansion, and MAX_OPEN_GRID entries otherwise), by waiting for the player's program to
+// release the arena.
+void serve_async_channel(char* shm_pos) {
+	unsigned int* sq_tail_ptr = &ASYNC_SQ_TAIL(shm_pos);
+	AsyncSubmission* sq = ASYNC_SQ_ARR(shm_pos);
+	AsyncReply reply = {shm_pos, 0, 0, 0, {}};
+	unsigned int sq_head = 0;
+	SpinPolicy policy;
+	while (true) {
+		// The two phase lock, same as `serve_sync_channel()`
+		unsigned int sq_tail = __atomic_load_n(sq_tail_ptr, __ATOMIC_ACQUIRE);
+		if (sq_tail == sq_head) {
+			bool hit = two_phase_wait(policy,
+				[&]() { return (sq_tail = __atomic_load_n(sq_tail_ptr, __ATOMIC_ACQUIRE)) != sq_head; },
+				[&]() {
+					__atomic_store_n(&ASYNC_SLEEPING_BIT(shm_pos), 1, __ATOMIC_SEQ_CST);
+					while ((sq_tail = __atomic_load_n(sq_tail_ptr, __ATOMIC_SEQ_CST)) == sq_head) {
+						futex_wait(sq_tail_ptr, sq_head);
+					}
+					__atomic_store_n(&ASYNC_SLEEPING_BIT(shm_pos), 0, __ATOMIC_RELAXED);
+				});
+			count_wait(policy, hit);
+		}
+		// Drain the submission ring
+		for (; sq_head != sq_tail; ++sq_head) {
+			AsyncSubmission request = sq[sq_head%ASYNC_RING_SIZE];
+			if (request.flags & ASYNC_SUBMISSION_FLAG_CLOSE) {
+				reply.tag = request.tag;
+				publish_async_completion(reply, 0, 0);
+				return;
 			}
+			bool do_not_expand = request.flags & SHM_CLICK_FLAG_DO_NOT_EXPAND;
+			long one_grid = request.flags & SHM_CLICK_FLAG_RUNS ? 2 : 1;
+			reserve_async_arena(reply, do_not_expand ? one_grid : MAX_OPEN_GRID);
+			reply.tag = request.tag;
+			ReplyWriter writer = {
+				ASYNC_ARENA(shm_pos) + reply.arena_pos%ASYNC_ARENA_SIZE, 0, 0,
+				flush_async_chunk, &reply, (bool)(request.flags & SHM_CLICK_FLAG_RUNS)};
+			int count = serve_click(
+				request.r, request.c,
+				request.flags & SHM_CLICK_FLAG_SKIP_WHEN_REOPEN, do_not_expand,
+				request.flags & SHM_CLICK_FLAG_NEW_ONLY, writer);
+			publish_async_completion(reply, count, writer.runs ? ASYNC_COMPLETION_FLAG_RUNS : 0);
 		}
-		// I'm wake up
-		// Cleanup
-		SHM_PENDING_BIT(shm_pos) = 0;
-		SHM_SLEEPING_BIT(shm_pos) = 0;
-		// There is a new `click()` request
-		long click_r = SHM_CLICK_R(shm_pos);
-		long click_c = SHM_CLICK_C(shm_pos);
-		bool skip_when_reopen = SHM_SKIP_WHEN_REOPEN_BIT(shm_pos);
-		bool do_not_expand = SHM_DO_NOT_EXPAND_BIT(shm_pos);
-		
-		if (do_not_expand) {
-			set_is_open(click_r, click_c);
-			if (test_is_mine(click_r, click_c)) {
-				SHM_OPENED_GRID_COUNT(shm_pos) = -1;
-			} else {
-				SHM_OPENED_GRID_COUNT(shm_pos) = 1;
-				(*SHM_OPENED_GRID_ARR(shm_pos))[0][0] = click_r;
-				(*SHM_OPENED_GRID_ARR(shm_pos))[0][1] = click_c;
-				(*SHM_OPENED_GRID_ARR(shm_pos))[0][2] = get_adj_mine(click_r, click_c);
-			}
-		} else if (skip_when_reopen && test_is_open(click_r, click_c)) {
-			// This grid has been opened before, and the player's program says
-			// that "If the grid has been opened before, plz skip it"
-			// So we just put -2 (non-mine) or -3 (is-mine) into SHM_OPEN_GRID_COUNT and return
-			SHM_OPENED_GRID_COUNT(shm_pos) = test_is_mine(click_r, click_c) ? -3 : -2;
+	}
+}
+
+
+/*
+ * Spawning worker threads
+ *	Creating a thread takes tens of microseconds, which adds up when the
+ * player's program creates hundreds of channels. So the main thread never
+ * waits for a new worker thread: it initializes the shm region of a channel
+ * itself, and hands the channel over to an idle worker thread (see
+ * `WorkerSlot`), spawning one only if none is idle. With
+ * MINESWEEPER_GS_PRESPAWN_WORKERS, that many idle worker threads are spawned
+ * before the game starts, so creating up to that many channels does not
+ * create any thread at all.
+ *	When the player's program closes a channel (see `Channel::close()`), its
+ * worker thread becomes idle again, and its ID (hence its shm region) is put
+ * into a free list and reused by the next channel created, so short-lived
+ * channels neither pile up threads nor run out of IDs.
+ */
+
+// WorkerSlot - The mailbox of a worker thread. The main thread fills in the
+// channel and posts `assigned`
+struct WorkerSlot {
+	sem_t assigned;
+	int channel_id;
+	bool is_async;
+	long core_pair;	// The core pair of the player's thread which creates the channel
+};
+
+// Worker threads which have not been assigned a channel yet
+pthread_mutex_t idle_workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+vector<WorkerSlot*> idle_workers;
+
+// worker_thread_routine - Thread routine for a worker thread
+// The argument is its `WorkerSlot`. When its channel is closed, it releases
+// the channel ID and becomes idle again, waiting for the next channel
+void* worker_thread_routine(void* arg) {
+	WorkerSlot* slot = (WorkerSlot*)arg;
+	register_worker_thread();
+	while (true) {
+		P(&slot->assigned);
+		bind_worker_thread(slot->core_pair);
+		int channel_id = slot->channel_id;
+		my_open_counter = open_counters + channel_id;
+		my_worker_stats = worker_stats + channel_id;
+		char* shm_pos = shm_start + CHANNEL_SHM_SIZE*channel_id;
+		if (slot->is_async) {
+			serve_async_channel(shm_pos);
 		} else {
-			if (test_is_mine(click_r, click_c)) {
-				// This grid contains a mine, BOOM SHAKALAKA!
-				set_is_open(click_r, click_c);
-				SHM_OPENED_GRID_COUNT(shm_pos) = -1;
-			} else if (get_adj_mine(click_r, click_c)) {
-				// This grid contains a non-zero number
-				set_is_open(click_r, click_c);
-				SHM_OPENED_GRID_COUNT(shm_pos) = 1;
-				(*SHM_OPENED_GRID_ARR(shm_pos))[0][0] = click_r;
-				(*SHM_OPENED_GRID_ARR(shm_pos))[0][1] = click_c;
-				(*SHM_OPENED_GRID_ARR(shm_pos))[0][2] = get_adj_mine(click_r, click_c);
-			} else {
-				// This grid contains zero
-				// BFS is needed
-				int level = find_available_level();
-				long result_open_count = 0;
-				worker_thread_bfs(
-					click_r, click_c, level, result_open_count,
-					*SHM_OPENED_GRID_ARR(shm_pos));
-				SHM_OPENED_GRID_COUNT(shm_pos) = result_open_count;
-				release_level(level);
+			serve_sync_channel(shm_pos);
+		}
+		// The channel is closed
+		release_channel_id(channel_id);
+		int oldstate = Defer_cancel();
+		Pthread_mutex_lock(&idle_workers_mutex);
+		idle_workers.push_back(slot);
+		Pthread_mutex_unlock(&idle_workers_mutex);
+		Restore_cancel(oldstate);
+	}
+	return NULL;
+}
+
+// spawn_worker_thread - Create a worker thread waiting for a channel, and
+// return its slot
+WorkerSlot* spawn_worker_thread() {
+	WorkerSlot* slot = (WorkerSlot*)Malloc(sizeof(WorkerSlot));
+	Sem_init(&slot->assigned, 0, 0);
+	pthread_t tid;
+	Pthread_create(&tid, NULL, worker_thread_routine, slot);
+	return slot;
+}
+
+// prespawn_worker_threads - Spawn `num_prespawn_workers` idle worker threads
+void prespawn_worker_threads() {
+	Pthread_mutex_lock(&idle_workers_mutex);
+	for (int i = 0; i < num_prespawn_workers; ++i) {
+		idle_workers.push_back(spawn_worker_thread());
+	}
+	Pthread_mutex_unlock(&idle_workers_mutex);
+}
+
+// create_worker_channel - Create a channel (an asynchronous one if `is_async`)
+// and hand it over to a worker thread. Return its ID
+int create_worker_channel(bool is_async, long core_pair) {
+	int channel_id = allocate_channel_id();
+	char* shm_pos = shm_start + CHANNEL_SHM_SIZE*channel_id;
+	if (is_async) {
+		init_async_shm_region(shm_pos);
+	} else {
+		init_shm_region(shm_pos);
+	}
+	WorkerSlot* slot;
+	Pthread_mutex_lock(&idle_workers_mutex);
+	if (idle_workers.empty()) {
+		slot = spawn_worker_thread();
+	} else {
+		slot = idle_workers.back();
+		idle_workers.pop_back();
+	}
+	Pthread_mutex_unlock(&idle_workers_mutex);
+	slot->channel_id = channel_id;
+	slot->is_async = is_async;
+	slot->core_pair = core_pair;
+	V(&slot->assigned);
+	return channel_id;
+}
+
+
+/*
+ * Thread pool
+ *	If `num_pool_threads` is positive, a 'C' does not create a worker thread.
+ * Instead, channels are served by a fixed pool of threads. To submit a
+ * request, the player's program sets the bit of the channel in the doorbell
+ * bitmap (see "Layout of the global region" in `shm.h`). A thread in the pool
+ * claims a request by clearing its bit atomically, serves it like a worker
+ * thread, and then looks for the next one. The i-th thread prefers channels
+ * whose ID % num_pool_threads == i, and steals requests of other channels
+ * only when none of its own channels is pending. Like worker threads, a thread
+ * in the pool spins for a while when there is nothing to do, and then sleeps
+ * on SHM_POOL_SEQ.
+ */
+
+// The words of the doorbell bitmap are scanned starting from this one, so
+// that channels with small IDs do not starve the others
+thread_local long pool_scan_start;
+
+// claim_pending_channel - Find a pending channel in the doorbell bitmap and
+// clear its bit. Return its ID, or -1 if there is no pending channel
+int claim_pending_channel(unsigned long* doorbell, long pool_id) {
+	long num_words = (min(next_channel_id.load(), MAX_CHANNEL) + 63)/64;
+	// Our own channels first, and then the others
+	for (int steal = 0; steal < 2; ++steal) {
+		for (long i = 0; i < num_words; ++i) {
+			long w = (pool_scan_start + i) % num_words;
+			unsigned long word = __atomic_load_n(doorbell+w, __ATOMIC_RELAXED);
+			while (word) {
+				long bit = __builtin_ctzl(word);
+				word &= word-1;
+				if (!steal && (w*64+bit) % num_pool_threads != pool_id) continue;
+				unsigned long old = __atomic_fetch_and(doorbell+w, ~(1UL<<bit), __ATOMIC_ACQ_REL);
+				if (old>>bit & 1) {
+					pool_scan_start = w+1;
+					return w*64+bit;
+				}
 			}
 		}
+	}
+	return -1;
+}
 
-		// Done
-		SHM_DONE_BIT(shm_pos) = 1;
+// pool_thread_routine - Thread routine for a thread in the pool. The
+// argument is its index in the pool
+void* pool_thread_routine(void* arg) {
+	long pool_id = (long)arg;
+	register_worker_thread();
+	char* gpos = GLOBAL_SHM_POS(shm_start);
+	unsigned long* doorbell = SHM_POOL_DOORBELL(gpos);
+	// A thread in the pool serves many channels, so the waiting time it
+	// estimates is the one of the whole pool
+	SpinPolicy policy;
+	while (true) {
+		// The two phase lock. First we spin for a while
+		int channel_id = claim_pending_channel(doorbell, pool_id);
+		bool hit = true;
+		if (channel_id < 0) {
+			hit = two_phase_wait(policy,
+				[&]() { return (channel_id = claim_pending_channel(doorbell, pool_id)) >= 0; },
+				[&]() {
+					// Then we go to sleep. We announce it and check the doorbell again
+					// (both are SEQ_CST), so that either we see the request, or the
+					// player's program sees us and increases SHM_POOL_SEQ, in which
+					// case `futex_wait` returns immediately
+					while (channel_id < 0) {
+						unsigned int seq = __atomic_load_n(&SHM_POOL_SEQ(gpos), __ATOMIC_SEQ_CST);
+						__atomic_fetch_add(&SHM_POOL_SLEEPERS(gpos), 1, __ATOMIC_SEQ_CST);
+						channel_id = claim_pending_channel(doorbell, pool_id);
+						if (channel_id < 0) {
+							futex_wait(&SHM_POOL_SEQ(gpos), seq);
+						}
+						__atomic_fetch_sub(&SHM_POOL_SLEEPERS(gpos), 1, __ATOMIC_SEQ_CST);
+					}
+				});
+		}
+		// Serve the request
+		char* shm_pos = shm_start + CHANNEL_SHM_SIZE*channel_id;
+		my_open_counter = open_counters + channel_id;
+		my_worker_stats = worker_stats + channel_id;
+		my_parked_reply = parked_replies + channel_id;
+		count_wait(policy, hit);
+		if (my_parked_reply->num_chunks) {
+			// The player's program has consumed a chunk of the parked reply
+			resume_parked_reply(shm_pos, *my_parked_reply);
+			continue;
+		}
+		bool closed;
+		serve_request(shm_pos, closed);
+		if (my_reply_is_parked) {
+			my_reply_is_parked = false;
+			resume_parked_reply(shm_pos, *my_parked_reply);
+		}
+		if (closed) {
+			release_channel_id(channel_id);
+		}
 	}
 
 	return NULL;
 }
 
+// start_thread_pool - Create the threads in the pool, and tell the player's
+// program to use the doorbell bitmap
+void start_thread_pool() {
+	SHM_POOL_MODE(GLOBAL_SHM_POS(shm_start)) = 1;
+	for (long i = 0; i < num_pool_threads; ++i) {
+		pthread_t tid;
+		Pthread_create(&tid, NULL, pool_thread_routine, (void*)i);
+	}
+}
+
+// create_pooled_channel - Create a channel served by the thread pool. Return
+// its ID
+int create_pooled_channel() {
+	int channel_id = allocate_channel_id();
+	init_shm_region(shm_start + CHANNEL_SHM_SIZE*channel_id);
+	return channel_id;
+}
+
 
 /*
  * Functions and variables for the main thread
@@ -453,12 +2725,23 @@ void* worker_thread_routine(void* arg) {
 // Kill all worker threads and report some error to the judger
 void kill_worker_threads() {
 	Pthread_mutex_lock(&worker_thread_tids_mutex);
+	worker_threads_killed = true;
 	for (pthread_t tid : worker_thread_tids) {
 		Pthread_cancel(tid);
 	}
 	Pthread_mutex_unlock(&worker_thread_tids_mutex);
 }
 
+// join_worker_threads - Wait for the worker threads killed by
+// `kill_worker_threads()` to terminate. Only for the main thread
+void join_worker_threads() {
+	Pthread_mutex_lock(&worker_thread_tids_mutex);
+	for (pthread_t tid : worker_thread_tids) {
+		Pthread_join(tid, NULL);
+	}
+	Pthread_mutex_unlock(&worker_thread_tids_mutex);
+}
+
 // Send something to the judger
 void report_error_to_judger(const char* error_s) {
 	Pthread_mutex_lock(&worker_thread_tids_mutex);
@@ -466,41 +2749,165 @@ void report_error_to_judger(const char* error_s) {
 	Pthread_mutex_unlock(&worker_thread_tids_mutex);
 }
 
+// revealed_backfill_routine - Thread routine for publishing the grids opened
+// before the revealed board is enabled. The i-th thread is responsible for
+// the rows in [band_start(i), band_start(i+1))
+void* revealed_backfill_routine(void* arg) {
+	long thread_id = (long)arg;
+	// Order the loads of `is_open` after the store of `revealed_plane`
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (long r = band_start(thread_id); r < band_start(thread_id+1); ++r) {
+		for (long c = 0; c < N; ++c) {
+			if (test_is_open(r, c)) {
+				publish_revealed(revealed_plane, r, c);
+			}
+		}
+	}
+	return NULL;
+}
+
+// enable_revealed_board - Create the revealed board, and fill in the grids
+// opened so far (see "Revealed board"). Return false if there is no space for it
+bool enable_revealed_board() {
+	if (revealed_plane) return true;
+	unsigned char* plane = map_shm_plane(shm_name, REVEALED_PLANE_OFFSET(N), REVEALED_PLANE_SIZE(N), true, huge_page_mode);
+	if (!plane) {
+		log("Warning: failed to create the revealed board (%s)\n", strerror(errno));
+		return false;
+	}
+	__atomic_store_n(&revealed_plane, plane, __ATOMIC_SEQ_CST);
+	run_in_parallel(revealed_backfill_routine);
+	return true;
+}
+
+// open_bitmap_backfill_routine - Thread routine for putting the non-mine
+// grids opened before the shared open bitmap is enabled into it, like
+// `revealed_backfill_routine()`
+//	It works a word (64 grids of a row) at a time, so that enabling the
+// bitmap in the middle of a game on a large map does not cost N*N bit tests.
+// Rows shorter than a word (N < 64) are done grid by grid.
+void* open_bitmap_backfill_routine(void* arg) {
+	long thread_id = (long)arg;
+	// Order the loads of `is_open` after the store of `shared_open_bitmap`
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (long r = band_start(thread_id); r < band_start(thread_id+1); ++r) {
+		if (N < 64) {
+			for (long c = 0; c < N; ++c) {
+				if (test_is_open(r, c) && !test_is_mine(r, c)) {
+					long index = (r<<logN) + c;
+					__atomic_fetch_or(shared_open_bitmap + index/8, 0x1<<(index%8), __ATOMIC_RELEASE);
+				}
+			}
+			continue;
+		}
+		uint64_t* shared_row = (uint64_t*)(shared_open_bitmap + (r<<logN)/8);
+		for (long wc = 0; wc < N/64; ++wc) {
+			uint64_t bits = load_open_word(r, wc) & ~load_mine_word(r, wc);
+			if (bits) {
+				__atomic_fetch_or(shared_row + wc, bits, __ATOMIC_RELEASE);
+			}
+		}
+	}
+	return NULL;
+}
+
+// enable_open_bitmap - Create the shared open bitmap, and fill in the grids
+// opened so far (see "Shared open bitmap"). Return false if there is no space for it
+bool enable_open_bitmap() {
+	if (shared_open_bitmap) return true;
+	unsigned char* bitmap = map_shm_plane(shm_name, OPEN_BITMAP_OFFSET, OPEN_BITMAP_SIZE(N), true, huge_page_mode);
+	if (!bitmap) {
+		log("Warning: failed to create the open bitmap (%s)\n", strerror(errno));
+		return false;
+	}
+	__atomic_store_n(&shared_open_bitmap, bitmap, __ATOMIC_SEQ_CST);
+	run_in_parallel(open_bitmap_backfill_routine);
+	return true;
+}
+
 // main_thread_routine - Thread routine for the main thread.
 // (Actually this function is not a "thread routine" because it is not used
 // as an argument for `pthread_create`)
 void main_thread_routine() {
 	static constexpr int BUF_LEN = 16;
 	char buf[BUF_LEN];
-	fd_set monitor_fd_set;	// fd set for I/O multiplexing, including fd_from_pl and fd_from_ju
-	bool fd_from_pl_eofed = false;	// Whether the player has closed the connection
+	// I/O multiplexing over fd_from_pl and fd_from_ju. We use epoll rather
+	// than `select`, since fds passed to a session in the daemon mode may be
+	// larger than FD_SETSIZE
+	int epoll_fd = Epoll_create1(EPOLL_CLOEXEC);
+	Epoll_add(epoll_fd, fd_from_pl, EPOLLIN);
+	Epoll_add(epoll_fd, fd_from_ju, EPOLLIN);
 	while (true) {
-		FD_ZERO(&monitor_fd_set);
-		if (!fd_from_pl_eofed)
-			FD_SET(fd_from_pl, &monitor_fd_set);
-		FD_SET(fd_from_ju, &monitor_fd_set);
-		Select(max(fd_from_ju, fd_from_pl)+1, &monitor_fd_set, NULL, NULL, NULL);
-		if (FD_ISSET(fd_from_pl, &monitor_fd_set)) {
+		struct epoll_event event;
+		if (Epoll_wait(epoll_fd, &event, 1, -1) == 0) {
+			continue;
+		}
+		if (event.data.fd == fd_from_pl) {
 			// Received something from the player's program
 			int t = Read(fd_from_pl, buf, BUF_LEN);
 			if (t == 0) {
-				fd_from_pl_eofed = true;
+				// The player has closed the connection
+				Epoll_del(epoll_fd, fd_from_pl);
 				continue;
 			}
+			// Written by the player's program before it sends 'C' or 'A'
+			long core_pair = SHM_CREATE_CORE_PAIR(GLOBAL_SHM_POS(shm_start));
 			switch (buf[0]) {
 				case 'C':
 					// "I want to create a new channel"
-					pthread_t tid;
-					Pthread_create(&tid, NULL, worker_thread_routine, NULL);
+					reply_channel_id(num_pool_threads ? create_pooled_channel() : create_worker_channel(false, core_pair));
+					break;
+				case 'A':
+					// "I want to create a new asynchronous channel"
+					reply_channel_id(create_worker_channel(true, core_pair));
+					break;
+				case 'M': {
+					// "I want to create many new channels", followed by their number
+					int num_channels;
+					memcpy(&num_channels, buf+1, sizeof(int));
+					if (t != 1+(int)sizeof(int) || num_channels < 1 || num_channels > MAX_CHANNEL) {
+						log("Error! Invalid number of channels from the player's program: %d\n", num_channels);
+						log(this_is_a_bug_str);
+						exit(1);
+					}
+					// The channels are usually handed to many player's threads,
+					// so their worker threads are not bound, instead of all
+					// piling up on the partner core of the creating thread
+					static int channel_ids[MAX_CHANNEL];
+					for (int i = 0; i < num_channels; ++i) {
+						channel_ids[i] = num_pool_threads ? create_pooled_channel() : create_worker_channel(false, -1);
+					}
+					// Binary IDs, read by the player's program in one go
+					Write(fd_to_pl, channel_ids, num_channels*sizeof(int));
+					break;
+				}
+				case 'R': {
+					// "I want the revealed board". Reply "1" if it is ready, or "0"
+					const char* reply = enable_revealed_board() ? "1" : "0";
+					Write(fd_to_pl, reply, strlen(reply)+1);
+					break;
+				}
+				case 'B': {
+					// "I want the open bitmap". Reply "1" if it is ready, or "0"
+					const char* reply = enable_open_bitmap() ? "1" : "0";
+					Write(fd_to_pl, reply, strlen(reply)+1);
 					break;
+				}
 				default:
 					log("Error! Received something unknown from the player's program: %c (ASCII=%d)\n", buf[0], int(buf[0]));
 					log(this_is_a_bug_str);
 					exit(1);
 			}
-		} else if (FD_ISSET(fd_from_ju, &monitor_fd_set)) {
+		} else if (event.data.fd == fd_from_ju) {
 			// Received something from the judger
-			Read(fd_from_ju, buf, BUF_LEN);
+			if (Read(fd_from_ju, buf, BUF_LEN) == 0) {
+				// The judger is gone without asking for the result. When launched
+				// by the judger, we would have been killed already (see
+				// `exit_when_parent_dies()`), but a session of a daemon is not
+				log("The judger has closed the connection. Exiting.\n");
+				kill_worker_threads();
+				exit(0);
+			}
 			switch (buf[0]) {
 				case 'F':
 					// "Finish judging, please report the result to the judger"
@@ -520,26 +2927,156 @@ void main_thread_routine() {
 	}
 }
 
+
+/*
+ * Daemon mode
+ *	With MINESWEEPER_GS_DAEMON_SOCKET, the game server is not launched by the
+ * judger. It loads the map once, and then hosts any number of judging
+ * sessions on that map at the same time: a judger with the same envariable
+ * hands its session over through the socket (see `session.h`), and the daemon
+ * forks a child for it, which then works exactly like a game server launched
+ * by the judger. So a session pays neither for exec nor for loading the map.
+ *	The children share the map and everything built from it (`adj_mine_table`,
+ * `zero_mask`, the zero components) with the daemon, since they never write
+ * them. A session only has its own `is_open` (in the tiled layout, it is a
+ * part of `board`, whose pages are copied as they are written), its channels
+ * (in the shm region created by its judger) and its threads.
+ *	The daemon waits for new sessions and for finished ones (SIGCHLD, through
+ * a signalfd) with epoll. It has no threads other than those loading the map,
+ * which have exited, so it is safe to fork.
+ */
+
+// same_file - Whether `path1` and `path2` are the same file
+bool same_file(const char* path1, const char* path2) {
+	struct stat stat1, stat2;
+	return stat(path1, &stat1) == 0 && stat(path2, &stat2) == 0
+		&& stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino;
+}
+
+// accept_session - Receive a session from the judger connected through
+// `conn`, and fork a child for it. Returns 0 in the child, which is set up to
+// serve the session, the PID of the child in the daemon, or -1 if the session
+// is rejected
+pid_t accept_session(int conn) {
+	static SessionRequest request;
+	int fds[NUM_SESSION_FDS];
+	if (!recv_session_request(conn, request, fds)) {
+		log("Warning: received a malformed session request, ignored.\n");
+		return -1;
+	}
+	char error[SESSION_ERROR_LEN] = "";
+	pid_t pid = -1;
+	if (!same_file(request.map_file_path, map_file_path)) {
+		snprintf(error, sizeof(error), "The game server daemon serves the map %.100s, not %.100s",
+			map_file_path, request.map_file_path);
+	} else if ((pid = fork()) < 0) {
+		snprintf(error, sizeof(error), "The game server daemon failed to fork: %s", strerror(errno));
+	} else if (pid == 0) {
+		// I am the session
+		fd_to_pl = fds[SESSION_FD_TO_PL];
+		fd_from_pl = fds[SESSION_FD_FROM_PL];
+		fd_to_ju = fds[SESSION_FD_TO_JU];
+		fd_from_ju = fds[SESSION_FD_FROM_JU];
+		shm_name = request.shm_name;
+		if (request.core_pairs[0]) {
+			Setenv("MINESWEEPER_CORE_PAIRS", request.core_pairs, true);
+			num_core_pairs = parse_core_pairs(core_pairs);
+		}
+		return 0;
+	}
+	send_session_reply(conn, error);
+	for (int fd : fds) {
+		Close(fd);
+	}
+	return pid;
+}
+
+// run_daemon - Host sessions (see "Daemon mode"). It only returns in the child
+// of a session
+void run_daemon() {
+	int listen_fd = listen_on_session_socket(daemon_socket_path);
+	sigset_t sigchld_set, prev_set;
+	Sigemptyset(&sigchld_set);
+	Sigaddset(&sigchld_set, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &sigchld_set, &prev_set);
+	int signal_fd = Signalfd(&sigchld_set, SFD_CLOEXEC);
+	int epoll_fd = Epoll_create1(EPOLL_CLOEXEC);
+	Epoll_add(epoll_fd, listen_fd, EPOLLIN);
+	Epoll_add(epoll_fd, signal_fd, EPOLLIN);
+	log("Hosting sessions at %s\n", daemon_socket_path);
+	long num_sessions = 0;
+	while (true) {
+		struct epoll_event events[2];
+		int n = Epoll_wait(epoll_fd, events, 2, -1);
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.fd == signal_fd) {
+				// Some sessions have finished
+				struct signalfd_siginfo info;
+				Read(signal_fd, &info, sizeof(info));
+				int status;
+				pid_t pid;
+				while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+					num_sessions -= 1;
+					if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+						log("Warning: session %d exited abnormally (status: %d).\n", pid, status);
+					}
+				}
+				continue;
+			}
+			// A judger connects
+			int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (conn < 0) {
+				log("Warning: failed to accept a session: %s\n", strerror(errno));
+				continue;
+			}
+			pid_t pid = accept_session(conn);
+			Close(conn);
+			if (pid == 0) {
+				Close(epoll_fd);
+				Close(signal_fd);
+				Close(listen_fd);
+				Sigprocmask(SIG_SETMASK, &prev_set, NULL);
+				return;
+			}
+			if (pid > 0) {
+				num_sessions += 1;
+				log("Session %d started (%ld running)\n", pid, num_sessions);
+			}
+		}
+	}
+}
+
 int main(int argc, char* argv[]) {
 	prog_name = "Game Server";
-	exit_when_parent_dies();
 
 	read_env_vars();
+	if (!daemon_socket_path) {
+		exit_when_parent_dies();
+	}
 
 	read_map();
 
-	// Alloc space for `is_open`
-	is_open = (char*)Calloc(N*N/8, 1);
-	// Alloc space for `vis`
-	for (int i = 0; i < NUM_ACTIVE_WORKER_THREAD; ++i) {
-		vis[i] = (char*)Calloc(N*N/8, 1);
+	if (daemon_socket_path) {
+		run_daemon();
+		// From here on, we are the child of a session
+	}
+
+	// Alloc space for `is_open` (it is a part of `board` in the tiled layout)
+	if (board_layout == BOARD_LAYOUT_ROW) {
+		is_open = (char*)alloc_plane(N*N/8, huge_page_mode);
 	}
-	// Initialize vis_occupied_flags
-	for (int i = 0; i < NUM_ACTIVE_WORKER_THREAD; ++i) {
-		vis_occupied_flags[i].clear();
+	if (verify_flood) {
+		verify_flood_fill();
 	}
 
-	shm_start = open_shm(shm_name);
+	shm_start = open_shm(shm_name, huge_page_mode);
+	if (eager_open_bitmap) {
+		enable_open_bitmap();
+	}
+	if (num_pool_threads) {
+		start_thread_pool();
+	}
+	prespawn_worker_threads();
 	
 	// Send N and K to the players program, via `fd_to_pl`
 	char buf[64];
@@ -10,6 +10,11 @@
 
 	Usage: ./judger <path/to/player's/program> <path/to/map> [constant A (default: 8)] [time_limit (In seconds, default: +inf)] [path/to/game/server (Default: ./game_server)]
 
+		If the envariable MINESWEEPER_GS_DAEMON_SOCKET is set, the judger does
+	not launch a game server. Instead, it hands the game server's ends of the
+	pipes to the game server daemon listening at that path (see "Daemon mode"
+	in game_server.cpp), which must have loaded the same map.
+
 	Pipes:
 		When judging, the three programs (player, game server,judger) are connected by pipes as follow:
 
@@ -34,6 +39,8 @@
 #include "lib/log.h"
 #include "lib/common.h"
 #include "lib/shm.h"
+#include "lib/affinity.h"
+#include "lib/session.h"
 
 void usage(char* prog_name) {
 	printf("Usage: %s <path/to/player's/program> <path/to/map> [constant A] [time_limit (In seconds, default: +inf)] [path/to/game/server (Default: ./game_server)]\n", prog_name);
@@ -74,6 +81,7 @@ void create_pipe(int &read_fd, int &write_fd) {
 char* player_path;	// path to the player's program (executable file)
 char* map_file_path;	// path to the map
 char* game_server_path;	// path to the game server (executable file)
+char* daemon_socket_path;	// path to the socket of the game server daemon, or NULL
 int time_limit;			// time limit, in seconds
 int constant_A;
 
@@ -208,6 +216,18 @@ void create_shared_memory_region() {
 	Ftruncate(mem_fd, TOTAL_SHM_SIZE);
 }
 
+// hand_out_core_pairs - Split the cores we may run on into core pairs, and hand
+// them out to the game server and the player's program (see `affinity.h`)
+// through the envariable MINESWEEPER_CORE_PAIRS, which both children inherit
+void hand_out_core_pairs() {
+	static CorePair pairs[MAX_CORE_PAIRS];
+	static char buf[CORE_PAIRS_STR_LEN];
+	int n = compute_core_pairs(pairs);
+	if (n == 0) return;
+	format_core_pairs(pairs, n, buf);
+	Setenv("MINESWEEPER_CORE_PAIRS", buf, true);
+}
+
 void create_game_server() {
 	if ((game_server_pid = Fork()) == 0) {
 		// I am the child
@@ -250,6 +270,39 @@ void create_game_server() {
 	}
 }
 
+// hand_session_to_daemon - Instead of launching a game server, hand the
+// game server's ends of the pipes to the game server daemon
+void hand_session_to_daemon() {
+	static SessionRequest request;
+	strcpy(request.shm_name, shm_name);
+	strncpy(request.map_file_path, map_file_path, sizeof(request.map_file_path)-1);
+	char* pairs = Getenv("MINESWEEPER_CORE_PAIRS");
+	if (pairs) {
+		strncpy(request.core_pairs, pairs, sizeof(request.core_pairs)-1);
+	}
+	int fds[NUM_SESSION_FDS];
+	fds[SESSION_FD_TO_PL] = fd_gs_to_pl;
+	fds[SESSION_FD_FROM_PL] = fd_gs_from_pl;
+	fds[SESSION_FD_TO_JU] = fd_gs_to_ju;
+	fds[SESSION_FD_FROM_JU] = fd_gs_from_ju;
+
+	int sock = connect_to_session_socket(daemon_socket_path);
+	send_session_request(sock, request, fds);
+	char error[SESSION_ERROR_LEN];
+	recv_session_reply(sock, error);
+	Close(sock);
+	if (error[0]) {
+		Shm_unlink(shm_name);
+		app_error("%s\n", error);
+	}
+	log("The session is handed to the game server daemon at %s\n", daemon_socket_path);
+	// Same as `create_game_server()`
+	Close(fd_gs_from_ju);
+	Close(fd_gs_from_pl);
+	Close(fd_gs_to_ju);
+	Close(fd_gs_to_pl);
+}
+
 void create_player() {
 	if ((player_pid = Fork()) == 0) {
 		// I am the child
@@ -348,9 +401,12 @@ int main(int argc, char* argv[]) {
 	// Make sure all the files exist, and is executable
 	make_sure_file_exists(player_path, "player's program");
 	make_sure_file_exists(map_file_path, "the map");
-	make_sure_file_exists(game_server_path, "the game server");
 	make_sure_file_is_executable(player_path, "player's program");
-	make_sure_file_is_executable(game_server_path, "the game server");
+	daemon_socket_path = Getenv("MINESWEEPER_GS_DAEMON_SOCKET");
+	if (!daemon_socket_path) {
+		make_sure_file_exists(game_server_path, "the game server");
+		make_sure_file_is_executable(game_server_path, "the game server");
+	}
 
 	// Create pipes
 	// 命名规则：fd_A_to_B 代表这个 fd 归 A 所有，这个 fd 所对应的 PIPE 的另一端归程序 B 所有
@@ -367,6 +423,10 @@ int main(int argc, char* argv[]) {
 	// the user's program and the game server)
 	create_shared_memory_region();
 
+	// Decide which cores the threads of the player's program and the game
+	// server are bound to
+	hand_out_core_pairs();
+
 	// Set up the signal handlers
 	Signal(SIGCHLD, sigchld_handler);
 	Signal(SIGPIPE, sigpipe_handler);
@@ -376,7 +436,11 @@ int main(int argc, char* argv[]) {
 	// Launch the game server and the player's program
 	// We block all signals here, in order to prevent SIGCHLD from disturbing us.
 	block_all_signals();
-	create_game_server();
+	if (daemon_socket_path) {
+		hand_session_to_daemon();
+	} else {
+		create_game_server();
+	}
 	create_player();
 	Usleep(10000);	// Sleep for a short time, increase stability
 	Alarm(time_limit);	// Set up the alarm. When time is up, we should receive a SIGALRM signal
@@ -400,7 +464,15 @@ int main(int argc, char* argv[]) {
 		// This happens when the player's program does something bad (e.g. requesting
 		// too much channels; sends an invalid `click` response...)
 		char buf[1024];
-		Read(fd_ju_from_gs, buf, 1024);
+		if (Read(fd_ju_from_gs, buf, 1024) == 0) {
+			// A session of the game server daemon is not our child, so this is
+			// how we learn that it crashes
+			block_all_signals();
+			log("Error: The game server exits before the judger\n");
+			log(this_is_a_bug_str);
+			Shm_unlink(shm_name);
+			exit(1);
+		}
 		log("The game server sends this to judger: ");
 		fprintf(stderr, "\"%s\"\n", buf);
 		log("So the judger will count the score and exit immediately.\n");
@@ -0,0 +1,122 @@
+#include <sched.h>
+#include "wrappers.h"
+#include "log.h"
+#include "affinity.h"
+
+// read_first_int - Read the first integer in the file at `path`. Returns -1
+// if the file does not exist
+static int read_first_int(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (!f) return -1;
+	int x;
+	if (fscanf(f, "%d", &x) != 1) x = -1;
+	fclose(f);
+	return x;
+}
+
+// l2_group - The smallest core sharing the L2 cache with `core` (lists in
+// sysfs are sorted), or `core` itself if the topology is unknown
+static int l2_group(int core) {
+	char path[128];
+	for (int i = 0; ; ++i) {
+		sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", core, i);
+		int level = read_first_int(path);
+		if (level < 0) break;
+		if (level == 2) {
+			sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", core, i);
+			int first = read_first_int(path);
+			return first >= 0 ? first : core;
+		}
+	}
+	// No L2 information, try hyperthreads
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", core);
+	int first = read_first_int(path);
+	return first >= 0 ? first : core;
+}
+
+int compute_core_pairs(CorePair* pairs) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		return 0;
+	}
+	// Sort the cores by their L2 groups, so cores sharing the L2 cache are
+	// next to each other
+	static int cores[CPU_SETSIZE], groups[CPU_SETSIZE];
+	int num_cores = 0;
+	for (int core = 0; core < CPU_SETSIZE; ++core) {
+		if (!CPU_ISSET(core, &set)) continue;
+		int group = l2_group(core);
+		int i = num_cores++;
+		for (; i > 0 && groups[i-1] > group; --i) {
+			cores[i] = cores[i-1];
+			groups[i] = groups[i-1];
+		}
+		cores[i] = core;
+		groups[i] = group;
+	}
+	// Pair up the cores in each group. The cores left alone are paired with
+	// each other
+	int n = 0;
+	int alone = -1;
+	for (int i = 0; i < num_cores && n < MAX_CORE_PAIRS; ++i) {
+		if (i+1 < num_cores && groups[i+1] == groups[i]) {
+			pairs[n++] = {cores[i], cores[i+1]};
+			++i;
+		} else if (alone >= 0) {
+			pairs[n++] = {alone, cores[i]};
+			alone = -1;
+		} else {
+			alone = cores[i];
+		}
+	}
+	if (alone >= 0 && n < MAX_CORE_PAIRS) {
+		// Only one core is left, then both of them run on it
+		pairs[n++] = {alone, alone};
+	}
+	return n;
+}
+
+void format_core_pairs(const CorePair* pairs, int n, char* buf) {
+	buf[0] = '\0';
+	char* pos = buf;
+	for (int i = 0; i < n; ++i) {
+		pos += sprintf(pos, i ? ",%d:%d" : "%d:%d", pairs[i].player_core, pairs[i].server_core);
+	}
+}
+
+int parse_core_pairs(CorePair* pairs) {
+	const char* s = Getenv("MINESWEEPER_CORE_PAIRS");
+	if (!s) return 0;
+	int n = 0;
+	int len;
+	while (n < MAX_CORE_PAIRS && sscanf(s, "%d:%d%n", &pairs[n].player_core, &pairs[n].server_core, &len) == 2) {
+		++n;
+		s += len;
+		if (*s != ',') break;
+		++s;
+	}
+	return n;
+}
+
+void bind_thread_to_core(int core) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc != 0) {
+		log("Warning: failed to bind a thread to core %d: %s\n", core, strerror(rc));
+	}
+}
+
+void unbind_thread(void) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(getpid(), sizeof(set), &set) < 0) {
+		return;
+	}
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc != 0) {
+		log("Warning: failed to unbind a thread: %s\n", strerror(rc));
+	}
+}
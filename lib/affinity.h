@@ -0,0 +1,47 @@
+/*
+	affinity.h - Binding threads to CPU cores
+
+		The judger splits the CPU cores it may run on into "core pairs", and
+	hands them out to both the player's program and the game server in the
+	envariable MINESWEEPER_CORE_PAIRS, e.g. "0:4,1:5,2:6,3:7". A player's
+	thread which creates channels is bound to the first core of a pair, and the
+	worker threads of those channels are bound to the second one, so the
+	scheduler does not move the spinning threads around, and the cache lines of
+	a channel only travel between two fixed cores. The two cores of a pair
+	share the L2 cache when the topology allows it (e.g. two hyperthreads of a
+	physical core).
+*/
+#ifndef __MINESWEEPER_AFFINITY_H__
+#define __MINESWEEPER_AFFINITY_H__
+
+struct CorePair {
+	int player_core;
+	int server_core;
+};
+
+constexpr int MAX_CORE_PAIRS = 512;
+
+// The length of the longest MINESWEEPER_CORE_PAIRS
+constexpr int CORE_PAIRS_STR_LEN = MAX_CORE_PAIRS*16;
+
+// compute_core_pairs - Split the cores the calling process may run on into
+// pairs (see above). Returns the number of pairs
+int compute_core_pairs(CorePair* pairs);
+
+// format_core_pairs - Write `n` pairs in the format of MINESWEEPER_CORE_PAIRS
+// into `buf`, which has CORE_PAIRS_STR_LEN bytes
+void format_core_pairs(const CorePair* pairs, int n, char* buf);
+
+// parse_core_pairs - Parse MINESWEEPER_CORE_PAIRS. Returns the number of
+// pairs, or 0 if it does not exist
+int parse_core_pairs(CorePair* pairs);
+
+// bind_thread_to_core - Bind the calling thread to `core`. It only logs a
+// warning when failing, since binding is just an optimization
+void bind_thread_to_core(int core);
+
+// unbind_thread - Undo `bind_thread_to_core()`, i.e. let the calling thread
+// run on the cores its process (the main thread) may run on
+void unbind_thread(void);
+
+#endif	// __MINESWEEPER_AFFINITY_H__
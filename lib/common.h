@@ -10,4 +10,11 @@ void exit_when_parent_dies();
 
 constexpr int MAX_OPEN_GRID = 16384;
 
+// Tell the CPU that we are spinning (the `pause` instruction on x86)
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
 #endif	// __MINESWEEPER_COMMON_H__
\ No newline at end of file
@@ -1,17 +1,48 @@
 #include <cassert>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "wrappers.h"
 #include "common.h"
 #include "shm.h"
 #include "log.h"
 #include "futex.h"
+#include "affinity.h"
 #include "minesweeper_helpers.h"
 
+static_assert(CLICK_FLAG_SKIP_WHEN_REOPEN == SHM_CLICK_FLAG_SKIP_WHEN_REOPEN);
+static_assert(CLICK_FLAG_DO_NOT_EXPAND == SHM_CLICK_FLAG_DO_NOT_EXPAND);
+static_assert(CLICK_FLAG_NEW_ONLY == SHM_CLICK_FLAG_NEW_ONLY);
+static_assert(CLICK_FLAG_RUNS == SHM_CLICK_FLAG_RUNS);
+static_assert(MAX_CLICK_BATCH_SIZE == MAX_BATCH_SIZE);
+static_assert(MAX_RECT_GRIDS == SHM_MAX_RECT_GRIDS && SHM_RECT_CODE_MINE == 0xf);
+static_assert(sizeof(ClickRequest) == sizeof(unsigned short)*3);
+static_assert(ASYNC_QUEUE_DEPTH == ASYNC_RING_SIZE);
+static_assert(MAX_CHANNEL_COUNT == MAX_CHANNEL);
+static_assert(REVEALED_CODE_UNKNOWN == 0 && REVEALED_CODE_MINE == 0xf && REVEALED_CODE_NUMBER(0) == 1);
+
 static char* shm_name;
 static char* shm_start;
 static int fd_from_gs, fd_to_gs;
 static long _N, _K;
+static bool pool_mode;	// Whether the game server serves channels with a thread pool
+// The non-mine grids opened so far, written by the game server (see "Shared
+// open bitmap" in game_server.cpp). It is requested on the first
+// `click(r, c, true)`, see `map_open_bitmap()`
+static const unsigned char* open_bitmap;
+static int open_bitmap_state;	// 0: not requested yet, 1: mapped, -1: not available
+
+// Core pairs handed out by the judger (see `affinity.h`). It is empty if
+// MINESWEEPER_BIND_CORE_MODE is 0. A thread is bound to a pair when it creates
+// its first channel. Each pair is given to one thread only: threads which come
+// after all pairs are taken are not bound, so that they never share a core
+// with a bound thread while other cores are idle
+static CorePair core_pairs[MAX_CORE_PAIRS];
+static int num_core_pairs;
+static int next_core_pair;
+static thread_local int my_core_pair = -1;
 
-void minesweeper_init(long &N, long &K, int &constant_A) {
+void minesweeper_init(long &N, long &K, int &constant_A, int bind_core_mode) {
 	static bool is_minesweeper_init_called_before = false;
 	if (is_minesweeper_init_called_before) {
 		log("Error! Please call `minesweeper_init` only once.\n");
@@ -27,7 +58,9 @@ manually. Please invoke the judger.\n");
 	exit_when_parent_dies();
 	// Open the shared memory (shm) region
 	shm_name = Getenv_must_exist("MINESWEEPER_SHM_NAME");
-	shm_start = open_shm(shm_name);
+	// Both sides map the shm region, so the player's side follows the game
+	// server's MINESWEEPER_GS_HUGE_PAGES, which is inherited from the judger
+	shm_start = open_shm(shm_name, read_huge_page_mode());
 	// Get fds
 	fd_from_gs = atoi(Getenv_must_exist("MINESWEEPER_FD_PL_FROM_GS"));
 	fd_to_gs = atoi(Getenv_must_exist("MINESWEEPER_FD_PL_TO_GS"));
@@ -41,61 +74,241 @@ manually. Please invoke the judger.\n");
 		exit(1);
 	}
 	_N = N; _K = K;
+	pool_mode = SHM_POOL_MODE(GLOBAL_SHM_POS(shm_start));
+	if (bind_core_mode) {
+		num_core_pairs = parse_core_pairs(core_pairs);
+	}
 	// Get constant_A
 	constant_A = atoi(Getenv_must_exist("MINESWEEPER_CONSTANT_A"));
 }
 
-void minesweeper_init(int &N, int &K, int &constant_A) {
+void minesweeper_init(int &N, int &K, int &constant_A, int bind_core_mode) {
 	long _N, _K;
-	minesweeper_init(_N, _K, constant_A);
+	minesweeper_init(_N, _K, constant_A, bind_core_mode);
 	N = _N; K = _K;
 }
 
 pthread_mutex_t create_channel_mutex = PTHREAD_MUTEX_INITIALIZER;
-Channel create_channel(void) {
+// announce_core_pair - Tell the game server which core pair the calling
+// thread is bound to, so the worker threads of new channels can be bound to
+// its partner core. Called with `create_channel_mutex` held
+static void announce_core_pair() {
+	if (my_core_pair < 0 && next_core_pair < num_core_pairs) {
+		my_core_pair = next_core_pair++;
+		bind_thread_to_core(core_pairs[my_core_pair].player_core);
+	}
+	SHM_CREATE_CORE_PAIR(GLOBAL_SHM_POS(shm_start)) = my_core_pair;
+}
+
+// request_new_channel - Send `type` ('C' or 'A') to the game server and
+// return the ID of the new channel
+static int request_new_channel(char type) {
 	Pthread_mutex_lock(&create_channel_mutex);
-	Channel result;
-	// Send 'C' to the game server, through `fd_to_gs`
-	char c = 'C';
-	Write(fd_to_gs, &c, 1);
+	announce_core_pair();
+	// Send `type` to the game server, through `fd_to_gs`
+	Write(fd_to_gs, &type, 1);
 	// Get the channel ID
 	char buf[16];
+	int id;
 	Read(fd_from_gs, buf, 16);
-	sscanf(buf, "%d", &result.id);
+	sscanf(buf, "%d", &id);
+	Pthread_mutex_unlock(&create_channel_mutex);
+	return id;
+}
+
+// request_new_channels - Send an 'M' to the game server for `n` new channels,
+// and put their IDs into `ids`
+//	We don't know which threads will use them, so no core pair is announced,
+// and the game server does not bind their worker threads
+static void request_new_channels(int n, int* ids) {
+	Pthread_mutex_lock(&create_channel_mutex);
+	// 'M' and `n` in a single message
+	char buf[1+sizeof(int)];
+	buf[0] = 'M';
+	memcpy(buf+1, &n, sizeof(int));
+	Write(fd_to_gs, buf, sizeof(buf));
+	Rio_readn(fd_from_gs, ids, n*sizeof(int));
+	Pthread_mutex_unlock(&create_channel_mutex);
+}
+
+// check_layout_version - Make sure the game server uses the same layout of
+// channels as us
+static void check_layout_version(char* shm_pos) {
+	unsigned int version = SHM_LAYOUT_VERSION(shm_pos);
+	if (version != SHM_LAYOUT_VERSION_CURRENT) {
+		log("Error! The game server uses version %u of the channel layout, but this \
+`minesweeper_helpers` uses version %d. Please use the matching game server and helpers.\n",
+			version, SHM_LAYOUT_VERSION_CURRENT);
+		exit(1);
+	}
+}
+
+// Channel::init - Initialize the channel with ID `channel_id`
+void Channel::init(int channel_id) {
+	id = channel_id;
 	// Calculate `shm_pos`
+	shm_pos = shm_start + id*CHANNEL_SHM_SIZE;
+	check_layout_version(shm_pos);
+	next_chunk_index = 0;
+	wait_stats = {0, 0, 0};
+}
+
+Channel create_channel(void) {
+	Channel result;
+	result.init(request_new_channel('C'));
+	return result;
+}
+
+void create_channels(int n, Channel* channels) {
+	if (n < 1 || n > MAX_CHANNEL) {
+		log("Error! create_channels() can only create 1 ~ %d channels at once, but n = %d.\n", MAX_CHANNEL, n);
+		exit(1);
+	}
+	int ids[MAX_CHANNEL];
+	request_new_channels(n, ids);
+	for (int i = 0; i < n; ++i) {
+		channels[i].init(ids[i]);
+	}
+}
+
+AsyncChannel create_async_channel(void) {
+	AsyncChannel result;
+	result.id = request_new_channel('A');
 	result.shm_pos = shm_start + result.id*CHANNEL_SHM_SIZE;
+	check_layout_version(result.shm_pos);
+	result.sq_tail = 0;
+	result.cq_head = 0;
+	result.num_completed = 0;
+	result.arena_used_end = 0;
+	return result;
+}
+
+RevealedBoard get_revealed_board(void) {
+	static const unsigned char* plane;	// Mapped once, on the first success
+	Pthread_mutex_lock(&create_channel_mutex);
+	if (!plane) {
+		// Ask the game server to create it. The reply is "1" on success
+		char type = 'R';
+		Write(fd_to_gs, &type, 1);
+		char buf[16];
+		Read(fd_from_gs, buf, 16);
+		if (buf[0] == '1') {
+			plane = map_shm_plane(shm_name, REVEALED_PLANE_OFFSET(_N), REVEALED_PLANE_SIZE(_N), false, read_huge_page_mode());
+		}
+	}
 	Pthread_mutex_unlock(&create_channel_mutex);
+	RevealedBoard result;
+	result.plane = plane;
+	result.N = _N;
 	return result;
 }
 
-ClickResult Channel::click(long r, long c, bool skip_when_reopen) {
+static void check_click_args(long r, long c) {
 	if (r < 0 || c < 0 || r >= _N || c >= _N) {
 		log("Error! The player's program called `click(r, c)` with invalid arguments:\n");
 		log("R = %ld, C = %ld\n", r, c);
 		exit(1);
 	}
-	char* shm_pos = this->shm_pos;
-	ClickResult result;
-	result.is_skipped = false;
-	// Fill in `click_r` and `click_c`
-	SHM_CLICK_R(shm_pos) = (unsigned short)r;
-	SHM_CLICK_C(shm_pos) = (unsigned short)c;
-	SHM_SKIP_WHEN_REOPEN_BIT(shm_pos) = skip_when_reopen;
-	SHM_DO_NOT_EXPAND_BIT(shm_pos) = 0;
-	
-	// Wake up the corresponding thread in the game server
-	SHM_PENDING_BIT(shm_pos) = 1;
- 	if (SHM_SLEEPING_BIT(shm_pos)) {
-		futex_wake(SHM_PENDING_BIT_PTR(shm_pos));
+}
+
+// ring_doorbell - Tell the thread pool of the game server that the channel
+// `id` has a pending request, and wake up a thread in the pool if all of them
+// are sleeping. Both are SEQ_CST, see `pool_thread_routine()` in the game server
+// Returns whether `futex_wake` is called
+static bool ring_doorbell(int id) {
+	char* gpos = GLOBAL_SHM_POS(shm_start);
+	__atomic_fetch_or(SHM_POOL_DOORBELL(gpos) + id/64, 1UL<<(id%64), __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&SHM_POOL_SLEEPERS(gpos), __ATOMIC_SEQ_CST)) {
+		__atomic_fetch_add(&SHM_POOL_SEQ(gpos), 1, __ATOMIC_SEQ_CST);
+		futex_wake(&SHM_POOL_SEQ(gpos));
+		return true;
+	}
+	return false;
+}
+
+// The spin amount in `submit_and_wait()` before sleeping
+static constexpr int CLIENT_SPIN_AMOUNT = 4096;
+
+// submit_and_wait - Submit the request filled in the shm region by increasing
+// its sequence number, wake up the corresponding thread in the game server,
+// and wait for it to complete the request
+//	The new sequence number is stored before the sleeping bit is loaded, and
+// the worker thread sets the sleeping bit before it loads the sequence number
+// for the last time (all SEQ_CST), so either we see the sleeping bit, or it
+// sees our request and does not sleep. That's why one `futex_wake` is enough
+// for a request, and we never need to check the sleeping bit again.
+//	Like the worker threads of the game server, we first spin for a while, and
+// then announce that we are waiting (SHM_CLIENT_WAITING_BIT) and sleep on
+// SHM_DONE_SEQ, so a long request (e.g. a huge BFS) does not keep our core
+// busy. Both are SEQ_CST as well, see `publish_done()` in the game server.
+static void submit_and_wait(int id, char* shm_pos, ChannelStats &stats) {
+	unsigned int seq = __atomic_load_n(SHM_REQUEST_SEQ_PTR(shm_pos), __ATOMIC_RELAXED) + 1;
+	__atomic_store_n(SHM_REQUEST_SEQ_PTR(shm_pos), seq, __ATOMIC_SEQ_CST);
+	if (pool_mode) {
+		stats.num_futex_wakes += ring_doorbell(id);
+	} else if (__atomic_load_n(&SHM_SLEEPING_BIT(shm_pos), __ATOMIC_SEQ_CST)) {
+		futex_wake(SHM_REQUEST_SEQ_PTR(shm_pos));
+		stats.num_futex_wakes += 1;
 	}
 	// Wait for the game server to complete the request (by spinning)
-	while (!SHM_DONE_BIT(shm_pos)) {
-		if (SHM_SLEEPING_BIT(shm_pos)) {
-			futex_wake(SHM_PENDING_BIT_PTR(shm_pos));
+	for (int i = 0; i < CLIENT_SPIN_AMOUNT; ++i) {
+		if (__atomic_load_n(&SHM_DONE_SEQ(shm_pos), __ATOMIC_ACQUIRE) == seq) {
+			stats.num_spin_waits += 1;
+			return;
 		}
+		cpu_relax();
 	}
-	// Copy the result
-	int open_grid_count = SHM_OPENED_GRID_COUNT(shm_pos);
+	// Then we go to sleep
+	__atomic_store_n(&SHM_CLIENT_WAITING_BIT(shm_pos), 1, __ATOMIC_SEQ_CST);
+	unsigned int done_seq;
+	while ((done_seq = __atomic_load_n(SHM_DONE_SEQ_PTR(shm_pos), __ATOMIC_SEQ_CST)) != seq) {
+		futex_wait(SHM_DONE_SEQ_PTR(shm_pos), done_seq);
+	}
+	__atomic_store_n(&SHM_CLIENT_WAITING_BIT(shm_pos), 0, __ATOMIC_RELAXED);
+	stats.num_futex_waits += 1;
+}
+
+// map_open_bitmap - Return whether the shared open bitmap is mapped. The first
+// call asks the game server to create it ('B'). If it fails (e.g. /dev/shm is
+// full), we never ask again, and `click(r, c, true)` goes to the game server
+static bool map_open_bitmap() {
+	int state = __atomic_load_n(&open_bitmap_state, __ATOMIC_ACQUIRE);
+	if (state) {
+		return state > 0;
+	}
+	Pthread_mutex_lock(&create_channel_mutex);
+	state = open_bitmap_state;
+	if (!state) {
+		char type = 'B';
+		Write(fd_to_gs, &type, 1);
+		char buf[16];
+		Read(fd_from_gs, buf, 16);
+		state = -1;
+		if (buf[0] == '1') {
+			open_bitmap = map_shm_plane(shm_name, OPEN_BITMAP_OFFSET, OPEN_BITMAP_SIZE(_N), false, read_huge_page_mode());
+			state = 1;
+		}
+		__atomic_store_n(&open_bitmap_state, state, __ATOMIC_RELEASE);
+	}
+	Pthread_mutex_unlock(&create_channel_mutex);
+	return state > 0;
+}
+
+// test_open_bitmap - Whether (r, c) is a non-mine grid opened before
+static inline bool test_open_bitmap(long r, long c) {
+	long index = r*_N + c;
+	return __atomic_load_n(open_bitmap + index/8, __ATOMIC_ACQUIRE)>>(index%8)&0x1;
+}
+
+// parse_click_result - Fill in `result` according to the "how many grids are
+// opened" field and the array of opened grids, which are in runs if `in_runs`
+static void parse_click_result(
+	int open_grid_count, unsigned short (*open_grid_pos)[16384][3], bool in_runs,
+	ClickResult &result
+) {
+	result.is_skipped = false;
+	result.has_more = false;
+	result.in_runs = in_runs;
 	if (open_grid_count == -1) {
 		// The grid contains a mine, BOOM!
 		result.is_mine = true;
@@ -106,51 +319,304 @@ ClickResult Channel::click(long r, long c, bool skip_when_reopen) {
 	} else {
 		result.is_mine = false;
 		result.open_grid_count = open_grid_count;
-		result.open_grid_pos = SHM_OPENED_GRID_ARR(shm_pos);
+		result.open_grid_pos = open_grid_pos;
 	}
-	SHM_DONE_BIT(shm_pos) = 0;
+}
+
+// drain_chunks - Throw away the remaining chunks of the last result, so that the
+// game server can finish it and serve the next request
+void Channel::drain_chunks() {
+	ClickResult result = {};
+	while (next_chunk(result));
+}
+
+// start_chunks - Called after a reply is received. If the result `result`
+// is the 0-th chunk of a streamed reply, get ready for `next_chunk()`
+static unsigned int start_chunks(char* shm_pos, ClickResult &result) {
+	if (!result.is_mine && !result.is_skipped && SHM_CHUNK_MORE(shm_pos, 0)) {
+		result.has_more = true;
+		return 1;
+	}
+	return 0;
+}
+
+bool Channel::next_chunk(ClickResult &result) {
+	if (!next_chunk_index) {
+		return false;
+	}
+	char* shm_pos = this->shm_pos;
+	unsigned int k = next_chunk_index;
+	// Tell the game server that we no longer use the (k-1)-th chunk, and wake
+	// it up if it is waiting for this. Both are SEQ_CST, see `wait_for_chunk_ack()`
+	// and `resume_parked_reply()` in the game server
+	__atomic_store_n(SHM_CHUNK_ACK_PTR(shm_pos), k, __ATOMIC_SEQ_CST);
+	if (pool_mode && __atomic_load_n(&SHM_CHUNK_PARKED_BIT(shm_pos), __ATOMIC_SEQ_CST)
+		&& __atomic_exchange_n(&SHM_CHUNK_PARKED_BIT(shm_pos), 0, __ATOMIC_SEQ_CST)) {
+		wait_stats.num_futex_wakes += ring_doorbell(id);
+	}
+	if (__atomic_load_n(&SHM_CHUNK_SLEEPING_BIT(shm_pos), __ATOMIC_SEQ_CST)) {
+		futex_wake(SHM_CHUNK_ACK_PTR(shm_pos));
+	}
+	// Wait for the k-th chunk, spinning first and then sleeping on
+	// SHM_CHUNK_READY, same as `submit_and_wait()`
+	bool ready = false;
+	for (int i = 0; i < CLIENT_SPIN_AMOUNT; ++i) {
+		if (__atomic_load_n(SHM_CHUNK_READY_PTR(shm_pos), __ATOMIC_ACQUIRE) > k) {
+			ready = true;
+			break;
+		}
+		cpu_relax();
+	}
+	if (!ready) {
+		__atomic_store_n(&SHM_CHUNK_WAITING_BIT(shm_pos), 1, __ATOMIC_SEQ_CST);
+		unsigned int num_ready;
+		while ((num_ready = __atomic_load_n(SHM_CHUNK_READY_PTR(shm_pos), __ATOMIC_SEQ_CST)) <= k) {
+			futex_wait(SHM_CHUNK_READY_PTR(shm_pos), num_ready);
+		}
+		__atomic_store_n(&SHM_CHUNK_WAITING_BIT(shm_pos), 0, __ATOMIC_RELAXED);
+	}
+	// All chunks are in the same format
+	parse_click_result(SHM_CHUNK_COUNT(shm_pos, k), SHM_CHUNK_ARR(shm_pos, k), result.in_runs, result);
+	result.has_more = SHM_CHUNK_MORE(shm_pos, k);
+	next_chunk_index = result.has_more ? k+1 : 0;
+	return true;
+}
+
+void Channel::close() {
+	drain_chunks();
+	SHM_CLOSE_STATE(shm_pos) = SHM_CLOSE_REQUESTED;
+	submit_and_wait(id, shm_pos, wait_stats);
+	// `submit_and_wait()` may still write SHM_CLIENT_WAITING_BIT after the
+	// completion, so we tell the game server when we are really done
+	__atomic_store_n(&SHM_CLOSE_STATE(shm_pos), SHM_CLOSE_LEFT, __ATOMIC_RELEASE);
+	shm_pos = NULL;
+}
+
+ClickResult Channel::click(long r, long c, bool skip_when_reopen, bool new_only, bool runs) {
+	check_click_args(r, c);
+	drain_chunks();
+	char* shm_pos = this->shm_pos;
+	ClickResult result;
+	if (skip_when_reopen && map_open_bitmap() && test_open_bitmap(r, c)) {
+		// It would be skipped by the game server anyway
+		parse_click_result(-2, NULL, runs, result);
+		return result;
+	}
+	// Fill in `click_r` and `click_c`
+	SHM_CLICK_R(shm_pos) = (unsigned short)r;
+	SHM_CLICK_C(shm_pos) = (unsigned short)c;
+	SHM_SKIP_WHEN_REOPEN_BIT(shm_pos) = skip_when_reopen;
+	SHM_DO_NOT_EXPAND_BIT(shm_pos) = 0;
+	SHM_NEW_ONLY_BIT(shm_pos) = new_only;
+	SHM_RUNS_BIT(shm_pos) = runs;
+	
+	submit_and_wait(id, shm_pos, wait_stats);
+	// Copy the result
+	parse_click_result(SHM_OPENED_GRID_COUNT(shm_pos), SHM_OPENED_GRID_ARR(shm_pos), runs, result);
+	next_chunk_index = start_chunks(shm_pos, result);
 	return result;
 }
 
 ClickResult Channel::click_do_not_expand(long r, long c) {
-	if (r < 0 || c < 0 || r >= _N || c >= _N) {
-		log("Error! The player's program called `click(r, c)` with invalid arguments:\n");
-		log("R = %ld, C = %ld\n", r, c);
-		exit(1);
-	}
+	check_click_args(r, c);
+	drain_chunks();
 	char* shm_pos = this->shm_pos;
 	ClickResult result;
-	result.is_skipped = false;
 	SHM_CLICK_R(shm_pos) = (unsigned short)r;
 	SHM_CLICK_C(shm_pos) = (unsigned short)c;
 	SHM_SKIP_WHEN_REOPEN_BIT(shm_pos) = 0;
 	SHM_DO_NOT_EXPAND_BIT(shm_pos) = 1;
+	SHM_RUNS_BIT(shm_pos) = 0;
 	
-	// Wake up the corresponding thread in the game server
-	SHM_PENDING_BIT(shm_pos) = 1;
- 	if (SHM_SLEEPING_BIT(shm_pos)) {
-		futex_wake(SHM_PENDING_BIT_PTR(shm_pos));
+	submit_and_wait(id, shm_pos, wait_stats);
+	// Copy the result
+	// (the game server always returns -1 or 1 here)
+	parse_click_result(SHM_OPENED_GRID_COUNT(shm_pos), SHM_OPENED_GRID_ARR(shm_pos), false, result);
+	return result;
+}
+
+int Channel::click_batch(const ClickRequest* requests, int n, ClickResult* results) {
+	if (n <= 0 || n > MAX_BATCH_SIZE) {
+		log("Error! The player's program called `click_batch()` with invalid batch size: %d\n", n);
+		exit(1);
 	}
-	// Wait for the game server to complete the request (by spinning)
-	while (!SHM_DONE_BIT(shm_pos)) {
-		// We need to check `SHM_SLEEPING_BIT(shm_pos)` again and again, because
-		// of cache coherence problem, that is, a modification on the main memory
-		// by a process will not be reflexed on another process immediately.
-		if (SHM_SLEEPING_BIT(shm_pos)) {
-			futex_wake(SHM_PENDING_BIT_PTR(shm_pos));
+	for (int i = 0; i < n; ++i) {
+		check_click_args(requests[i].r, requests[i].c);
+	}
+	drain_chunks();
+	char* shm_pos = this->shm_pos;
+	memcpy(SHM_BATCH_REQUEST_ARR(shm_pos), requests, sizeof(ClickRequest)*n);
+	SHM_BATCH_SIZE(shm_pos) = n;
+
+	submit_and_wait(id, shm_pos, wait_stats);
+	// Copy the results
+	int num_served = SHM_OPENED_GRID_COUNT(shm_pos);
+	int (*batch_result_arr)[2] = *SHM_BATCH_RESULT_ARR(shm_pos);
+	unsigned short (*open_grid_arr)[3] = *SHM_OPENED_GRID_ARR(shm_pos);
+	for (int i = 0; i < num_served; ++i) {
+		parse_click_result(batch_result_arr[i][0],
+			(unsigned short (*)[16384][3])(open_grid_arr + batch_result_arr[i][1]),
+			requests[i].flags & CLICK_FLAG_RUNS, results[i]);
+	}
+	// Only the last served click may be streamed
+	next_chunk_index = start_chunks(shm_pos, results[num_served-1]);
+	// Reset the batch size, so that following clicks are not considered as batches
+	SHM_BATCH_SIZE(shm_pos) = 0;
+	return num_served;
+}
+
+// decode_run - Write the numbers of a run of `len` grids (4 bits each, see
+// "Run-length replies" in shm.h) into `dst`
+static inline void decode_run(const unsigned char* nibbles, long len, char* dst) {
+	long i = 0;
+#ifdef __SSE2__
+	// 16 grids at a time: take the low and the high halves of 8 bytes, and
+	// interleave them
+	const __m128i low_mask = _mm_set1_epi8(0xf);
+	for (; i+16 <= len; i += 16) {
+		__m128i bytes = _mm_loadl_epi64((const __m128i*)(nibbles + i/2));
+		__m128i low = _mm_and_si128(bytes, low_mask);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), low_mask);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi8(low, high));
+	}
+#endif
+	for (; i < len; ++i) {
+		dst[i] = nibbles[i/2]>>(i%2*4)&0xf;
+	}
+}
+
+long decode_click_result(const ClickResult &result, char* board, long row_stride) {
+	if (result.is_mine || result.is_skipped) {
+		return 0;
+	}
+	unsigned short (*entries)[3] = *result.open_grid_pos;
+	long count = result.open_grid_count;
+	if (!result.in_runs) {
+		for (long i = 0; i < count; ++i) {
+			board[entries[i][0]*row_stride + entries[i][1]] = entries[i][2];
 		}
+		return count;
 	}
-	// Copy the result
-	int open_grid_count = SHM_OPENED_GRID_COUNT(shm_pos);
-	if (open_grid_count == -1) {
-		// The grid contains a mine, BOOM!
-		result.is_mine = true;
-	} else {
-		result.is_mine = false;
-		// assert (open_grid_count == 1);
-		result.open_grid_count = 1;
-		result.open_grid_pos = SHM_OPENED_GRID_ARR(shm_pos);
+	long num_grids = 0;
+	for (long i = 0; i < count; ) {
+		long r = entries[i][0], c = entries[i][1], len = entries[i][2];
+		decode_run((const unsigned char*)entries[i+1], len, board + r*row_stride + c);
+		num_grids += len;
+		i += 1 + (len + SHM_RUN_GRIDS_PER_ENTRY-1)/SHM_RUN_GRIDS_PER_ENTRY;
 	}
-	SHM_DONE_BIT(shm_pos) = 0;
+	return num_grids;
+}
+
+RectResult Channel::click_rect(long r0, long c0, long h, long w) {
+	if (h <= 0 || w <= 0 || h*w > MAX_RECT_GRIDS) {
+		log("Error! The player's program called `click_rect()` with invalid size: %ld x %ld\n", h, w);
+		exit(1);
+	}
+	check_click_args(r0, c0);
+	check_click_args(r0+h-1, c0+w-1);
+	drain_chunks();
+	char* shm_pos = this->shm_pos;
+	SHM_CLICK_R(shm_pos) = (unsigned short)r0;
+	SHM_CLICK_C(shm_pos) = (unsigned short)c0;
+	SHM_RECT_H(shm_pos) = h;
+	SHM_RECT_W(shm_pos) = w;
+
+	submit_and_wait(id, shm_pos, wait_stats);
+	RectResult result;
+	result.r0 = r0;
+	result.c0 = c0;
+	result.h = h;
+	result.w = w;
+	result.num_mines = SHM_RECT_NUM_MINES(shm_pos);
+	result.num_newly_opened = SHM_RECT_NUM_NEW(shm_pos);
+	result.tile = (const unsigned char*)SHM_OPENED_GRID_ARR(shm_pos);
+	// Reset the height, so that following clicks are not considered as rectangles
+	SHM_RECT_H(shm_pos) = 0;
 	return result;
-}
\ No newline at end of file
+}
+
+bool AsyncChannel::submit(long r, long c, unsigned short flags, unsigned int tag) {
+	check_click_args(r, c);
+	if (in_flight() == ASYNC_RING_SIZE) {
+		return false;
+	}
+	push_submission(r, c, flags, tag);
+	return true;
+}
+
+// push_submission - Put a request into the submission ring, which must not
+// be full
+void AsyncChannel::push_submission(long r, long c, unsigned short flags, unsigned int tag) {
+	char* shm_pos = this->shm_pos;
+	ASYNC_SQ_ARR(shm_pos)[sq_tail%ASYNC_RING_SIZE] = {tag, (unsigned short)r, (unsigned short)c, flags};
+	sq_tail += 1;
+	// Publish the request, then wake up the worker thread if it is sleeping
+	// Both are SEQ_CST so that either we see the sleeping bit, or the worker
+	// thread sees the new tail before it goes to sleep
+	__atomic_store_n(&ASYNC_SQ_TAIL(shm_pos), sq_tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ASYNC_SLEEPING_BIT(shm_pos), __ATOMIC_SEQ_CST)) {
+		futex_wake(&ASYNC_SQ_TAIL(shm_pos));
+	}
+}
+
+bool AsyncChannel::poll(AsyncClickResult &result) {
+	char* shm_pos = this->shm_pos;
+	// The result returned last time is no longer used. The worker thread may be
+	// sleeping for room in the arena (both SEQ_CST, see `reserve_async_arena()`
+	// in the game server)
+	if (ASYNC_ARENA_RELEASED(shm_pos) != arena_used_end) {
+		__atomic_store_n(&ASYNC_ARENA_RELEASED(shm_pos), arena_used_end, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ASYNC_ARENA_SLEEPING_BIT(shm_pos), __ATOMIC_SEQ_CST)) {
+			futex_wake(ASYNC_ARENA_RELEASED_PTR(shm_pos));
+		}
+	}
+	if (cq_head == __atomic_load_n(&ASYNC_CQ_TAIL(shm_pos), __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	AsyncCompletion completion = ASYNC_CQ_ARR(shm_pos)[cq_head%ASYNC_CQ_RING_SIZE];
+	cq_head += 1;
+	result.tag = completion.tag;
+	parse_click_result(completion.count,
+		(unsigned short (*)[16384][3])ASYNC_ARENA(shm_pos)[completion.arena_pos%ASYNC_ARENA_SIZE],
+		completion.flags & ASYNC_COMPLETION_FLAG_RUNS, result.result);
+	result.result.has_more = completion.flags & ASYNC_COMPLETION_FLAG_MORE;
+	if (!result.result.has_more) {
+		num_completed += 1;
+	}
+	arena_used_end = completion.arena_pos + (completion.count > 0 ? completion.count : 0);
+	return true;
+}
+
+void AsyncChannel::wait(AsyncClickResult &result) {
+	if (in_flight() == 0) {
+		log("Error! The player's program called `AsyncChannel::wait()` with no click in flight.\n");
+		exit(1);
+	}
+	// Spin for a while, then sleep on ASYNC_CQ_TAIL, same as `submit_and_wait()`
+	for (int i = 0; i < CLIENT_SPIN_AMOUNT; ++i) {
+		if (poll(result)) {
+			return;
+		}
+		cpu_relax();
+	}
+	__atomic_store_n(&ASYNC_CLIENT_WAITING_BIT(shm_pos), 1, __ATOMIC_SEQ_CST);
+	unsigned int cq_tail;
+	while ((cq_tail = __atomic_load_n(&ASYNC_CQ_TAIL(shm_pos), __ATOMIC_SEQ_CST)) == cq_head) {
+		futex_wait(&ASYNC_CQ_TAIL(shm_pos), cq_tail);
+	}
+	__atomic_store_n(&ASYNC_CLIENT_WAITING_BIT(shm_pos), 0, __ATOMIC_RELAXED);
+	poll(result);
+}
+
+void AsyncChannel::close() {
+	AsyncClickResult result;
+	while (in_flight()) {
+		wait(result);
+	}
+	// The completion of the closing submission is the last one
+	push_submission(0, 0, ASYNC_SUBMISSION_FLAG_CLOSE, 0);
+	wait(result);
+	// The game server reuses the shm region after we leave, same as `Channel::close()`
+	__atomic_store_n(&SHM_CLOSE_STATE(shm_pos), SHM_CLOSE_LEFT, __ATOMIC_RELEASE);
+	shm_pos = NULL;
+}
@@ -1,6 +1,10 @@
 #ifndef __MINESWEEPER_HELPERS_H__
 #define __MINESWEEPER_HELPERS_H__
 
+// 绑核：为 1 时，第一次创建信道的线程会被绑定到评测机分配的一个核上，处理该线程所创建的
+// 信道的 game server 线程会被绑定到与之配对的核上（两个核尽量共享 L2 缓存）。每对核只分给
+// 一个线程，核对分完之后（例如 16 核的评测机上的第 9 个线程起）创建信道的线程不再绑核。如果你想
+// 自己管理线程的亲和性，请在 #include 本头文件之前 #define MINESWEEPER_BIND_CORE_MODE 0
 #ifndef MINESWEEPER_BIND_CORE_MODE
 #define MINESWEEPER_BIND_CORE_MODE 1	// Default: Bind thread to core
 #endif
@@ -20,6 +24,8 @@ struct ClickResult {
 	// 别忘了，如果你点的方格中的数字是零，那么它周围的方格也会被点开，并且这个过程可以递归
 	// 别忘了*2，每次“点开”一个包含数字 0 的格子时，你的程序会收到点开的格子所在的连通块中的
 	// 所有数字为 0 的格子以及边缘那些数字不为 0 的格子，哪怕这些格子已经被点开过。
+	// （除非指定了 new_only / CLICK_FLAG_NEW_ONLY，此时只会收到本次点击第一次点开的格子）
+	// 如果 in_runs 为 true，这个变量是 open_grid_pos 中的元素个数，而不是格子数
 	int open_grid_count;
 
 	// 一个长度为 open_grid_count 的数组
@@ -27,6 +33,71 @@ struct ClickResult {
 	// (*open_grid_pos)[i][1] 代表第 i 个被点开的格子所在的列
 	// (*open_grid_pos)[i][2] 代表第 i 个被点开的格子中的数字
 	unsigned short (*open_grid_pos)[16384][3];
+
+	// 结果是否按行程编码（指定了 runs / CLICK_FLAG_RUNS）
+	// 此时同一行中连续的若干个格子被编码为一段：一个元素 (行, 第一个格子的列, 格子数)，后面是
+	// 这些格子中的数字，每个数字占 4 bit，每个元素可以放 12 个数字。点开的区域很大时，结果会
+	// 小 10 倍左右。请用 decode_click_result() 解码
+	bool in_runs;
+
+	// 一次结果中至多有 16384 个格子。如果点开的格子比这更多，那么结果会被分成若干段，
+	// 本结果只是其中的一段，此时 has_more 为 true。请调用 Channel::next_chunk() 获取
+	// 下一段（对于 AsyncChannel，下一段会作为一个 tag 相同的结果由 poll() / wait() 取出）
+	bool has_more;
+};
+
+// click_batch 中每次点击的标志，可以按位或
+// CLICK_FLAG_SKIP_WHEN_REOPEN: 等同于调用 click() 时指定 skip_when_reopen = true
+// CLICK_FLAG_DO_NOT_EXPAND: 等同于调用 click_do_not_expand()
+// CLICK_FLAG_NEW_ONLY: 等同于调用 click() 时指定 new_only = true
+// CLICK_FLAG_RUNS: 等同于调用 click() 时指定 runs = true
+constexpr unsigned short CLICK_FLAG_SKIP_WHEN_REOPEN = 0x1;
+constexpr unsigned short CLICK_FLAG_DO_NOT_EXPAND = 0x2;
+constexpr unsigned short CLICK_FLAG_NEW_ONLY = 0x4;
+constexpr unsigned short CLICK_FLAG_RUNS = 0x8;
+
+// 一次 click_batch 最多包含多少次点击
+constexpr int MAX_CLICK_BATCH_SIZE = 64;
+
+// ClickRequest - click_batch 中的一次点击
+struct ClickRequest {
+	unsigned short r, c;
+	unsigned short flags;	// CLICK_FLAG_* 的按位或
+};
+
+// 一次 click_rect 最多包含多少个格子
+constexpr long MAX_RECT_GRIDS = 65536;
+
+// RectResult - click_rect 的结果
+struct RectResult {
+	long r0, c0, h, w;	// 矩形的位置和大小
+
+	// 矩形中地雷的个数
+	long num_mines;
+
+	// 矩形中第一次被点开的格子数（包括地雷）。被点开过的格子不会被重复计入得分
+	long num_newly_opened;
+
+	// 矩形中每个格子的内容，每个格子 4 bit，按行优先的顺序排列：格子 (r0+i, c0+j) 的下标为
+	// i*w+j，位于 tile[(i*w+j)/2] 的低 4 位（下标为偶数）或高 4 位（下标为奇数）
+	// 请用 get() 读取。tile 在下一次使用本 Channel 前有效
+	const unsigned char* tile;
+
+	// 格子 (r0+i, c0+j) 的内容：-1 表示地雷，否则为格子中的数字 (0 ~ 8)
+	int get(long i, long j) const {
+		long index = i*w + j;
+		int code = tile[index/2]>>(index%2*4)&0xf;
+		return code == 0xf ? -1 : code;
+	}
+};
+
+// ChannelStats - 信道的统计信息
+// 发出请求后，选手程序先自旋等待一小段时间；如果 game server 还没有完成，就用 futex 睡眠，
+// 把 CPU 让给其他线程（例如 game server），直到 game server 完成请求后将其唤醒
+struct ChannelStats {
+	long num_spin_waits;	// 自旋期间就等到了结果的请求数
+	long num_futex_waits;	// 睡眠后才等到结果的请求数
+	long num_futex_wakes;	// 为唤醒 game server 而进行的 futex_wake 系统调用次数
 };
 
 // Channel - 选手程序和 game server 间相互通信的信道
@@ -36,18 +107,152 @@ private:
 	int id;
 
 	char* shm_pos;
+	unsigned int next_chunk_index;	// 下一段结果的编号，0 表示没有未取出的段
+	ChannelStats wait_stats;
+
+	void init(int channel_id);
+	void drain_chunks();
 public:
-	ClickResult click(long r, long c, bool skip_when_reopen);
+	// 如果 new_only 为 true，点开数字为 0 的格子时只返回本次点击第一次点开的格子（之前已经被
+	// 点开过的格子不再返回，结果可能为空），间接点开的过程不变
+	// 如果 runs 为 true，结果按行程编码（见 ClickResult::in_runs）
+	ClickResult click(long r, long c, bool skip_when_reopen, bool new_only = false, bool runs = false);
 	ClickResult click_do_not_expand(long r, long c);
+
+	// 批量点击：在一次与 game server 的交互中依次完成 requests[0], requests[1], ...
+	// 这 n 次点击，第 i 次点击的结果存放在 results[i] 中。
+	// 返回值为实际完成的点击次数 m (1 <= m <= n)，只有 results[0 ~ m-1] 有效，请把
+	// 剩下的点击重新提交。带间接点开的点击可能点开很多格子，所以只有当它是这一批中
+	// 第一个点开了格子的点击时才会被完成；不带间接点开的点击总是能全部完成。
+	// results 中的 open_grid_pos 在下一次使用本 Channel 前有效。
+	int click_batch(const ClickRequest* requests, int n, ClickResult* results);
+
+	// 点开以 (r0, c0) 为左上角、h 行 w 列的矩形中的所有格子（不间接点开），只需要与 game server
+	// 交互一次。矩形必须在地图内，且 1 <= h*w <= MAX_RECT_GRIDS。点到的地雷和逐个调用
+	// click_do_not_expand() 一样会被计入得分，请只在确信矩形中没有雷（或者不在乎踩雷）时使用
+	// 复杂度为 Θ(h*w)，但比逐个点击快得多
+	RectResult click_rect(long r0, long c0, long h, long w);
+
+	// 如果上一次点击的结果（click_batch 中为最后一个结果）的 has_more 为 true，则取出
+	// 下一段结果放入 result 并返回 true；否则返回 false。game server 会在选手程序处理
+	// 当前段的同时准备下一段。调用后，上一段结果中的 open_grid_pos 不再有效。
+	// 用法：for (bool ok = true; ok; ok = channel.next_chunk(result)) { 处理 result }
+	// 如果在取完所有段之前就使用本 Channel 进行下一次点击，剩下的段会被丢弃
+	bool next_chunk(ClickResult &result);
+
+	// 本信道的统计信息
+	ChannelStats stats() const { return wait_stats; }
+
+	// 关闭本信道。game server 中处理本信道的线程和本信道的共享内存会被之后创建的信道复用，
+	// 所以关闭后创建的信道不计入 MAX_CHANNEL_COUNT 的限制。关闭后请不要再使用本 Channel
+	void close();
 	friend Channel create_channel(void);
+	friend void create_channels(int n, Channel* channels);
+};
+
+// AsyncClickResult - 异步信道中某一次点击的结果
+struct AsyncClickResult {
+	unsigned int tag;	// 提交这次点击时指定的 tag
+	ClickResult result;
+};
+
+// 一个异步信道中至多同时有多少个已提交但还没有取出结果的点击
+constexpr int ASYNC_QUEUE_DEPTH = 64;
+
+// AsyncChannel - 异步信道
+// 普通的 Channel 同一时刻只能有一个点击，game server 处理这个点击时选手程序只能干等。
+// 异步信道允许同时有多个点击在处理中，选手程序可以在 game server 处理点击的同时做自己
+// 的推理。点击按照提交的顺序依次完成。
+class AsyncChannel {
+private:
+	// Channel ID
+	int id;
+
+	char* shm_pos;
+	unsigned int sq_tail;	// 已提交的点击数
+	unsigned int cq_head;	// 已取出的结果数（包括分段结果中的每一段）
+	unsigned int num_completed;	// 已取出结果的点击数
+	unsigned long arena_used_end;	// 上一次取出的结果在 arena 中的结束位置
+
+	void push_submission(long r, long c, unsigned short flags, unsigned int tag);
+public:
+	// 提交一次点击，不等待其完成。flags 为 CLICK_FLAG_* 的按位或，tag 会原样出现在结果中
+	// 如果已经有 ASYNC_QUEUE_DEPTH 个点击还没有取出结果，则不提交并返回 false
+	bool submit(long r, long c, unsigned short flags, unsigned int tag = 0);
+
+	// 如果有已完成的点击，取出它的结果放入 result 并返回 true；否则立刻返回 false
+	// 注意：result 中的 open_grid_pos 在下一次调用 poll() 或 wait() 前有效
+	bool poll(AsyncClickResult &result);
+
+	// 等待下一个点击完成，并取出它的结果。调用前请确保有已提交但未取出结果的点击
+	void wait(AsyncClickResult &result);
+
+	// 已提交但还没有取出结果的点击数
+	int in_flight() const { return sq_tail - num_completed; }
+
+	// 关闭本信道，同 Channel::close()。还没有取出结果的点击的结果会被丢弃
+	void close();
+
+	friend AsyncChannel create_async_channel(void);
+};
+
+// 把 result 中的所有格子（两种格式均可）写入选手程序的棋盘：格子 (r, c) 中的数字写入
+// board[r*row_stride + c]。返回写入的格子数
+// 对于按行程编码的结果，每一段的数字会被成块地展开，比逐个格子处理快得多
+long decode_click_result(const ClickResult &result, char* board, long row_stride);
+
+// 已点开格子的状态，见 RevealedBoard::get()
+constexpr int REVEALED_UNKNOWN = -2;	// 还没有被点开
+constexpr int REVEALED_MINE = -1;	// 被点开的地雷
+
+// RevealedBoard - 所有已点开格子的只读共享视图
+// game server 每点开一个格子（无论是哪个线程、哪个信道的点击），都会在返回这次点击的结果之前
+// 更新这个视图，所以选手程序的各个线程可以共用它，而不必各自维护一份“已知的局面”。
+// 视图每个格子只占 4 bit（N = 65536 时为 2 GB），在第一次调用 get_revealed_board() 时创建
+class RevealedBoard {
+private:
+	const unsigned char* plane;
+	long N;
+public:
+	// 视图是否可用。如果共享内存的空间不足以容纳视图，get_revealed_board() 返回的视图不可用
+	bool valid() const { return plane != nullptr; }
+
+	// 格子 (r, c) 的状态：REVEALED_UNKNOWN、REVEALED_MINE 或者格子中的数字 (0 ~ 8)
+	int get(long r, long c) const {
+		long index = r*N + c;
+		int code = __atomic_load_n(plane + index/2, __ATOMIC_RELAXED)>>(index%2*4)&0xf;
+		return code == 0 ? REVEALED_UNKNOWN : code == 0xf ? REVEALED_MINE : code-1;
+	}
+
+	friend RevealedBoard get_revealed_board(void);
 };
 
 // 整个程序的初始化。
 // This should be called once and only once in the player's program
-void minesweeper_init(long &N, long &K, int &constant_A);
-void minesweeper_init(int &N, int &K, int &constant_A);
+void minesweeper_init(long &N, long &K, int &constant_A, int bind_core_mode);
+void minesweeper_init(int &N, int &K, int &constant_A, int bind_core_mode);
+inline void minesweeper_init(long &N, long &K, int &constant_A) {
+	minesweeper_init(N, K, constant_A, MINESWEEPER_BIND_CORE_MODE);
+}
+inline void minesweeper_init(int &N, int &K, int &constant_A) {
+	minesweeper_init(N, K, constant_A, MINESWEEPER_BIND_CORE_MODE);
+}
+
+// 最多可以同时有多少个信道（关闭的信道不算）
+constexpr int MAX_CHANNEL_COUNT = 1024;
 
 // 创建一个新的信道
 Channel create_channel(void);
 
+// 一次创建 n 个新的信道 (1 <= n <= MAX_CHANNEL_COUNT)，放入 channels[0 ~ n-1] 中
+// 与调用 n 次 create_channel() 等价，但只需要与 game server 交互一次。
+// 由于不知道这些信道会由哪些线程使用，它们不参与绑核（调用者与对应的 game server 线程都不会被绑定）
+void create_channels(int n, Channel* channels);
+
+// 创建一个新的异步信道
+AsyncChannel create_async_channel(void);
+
+// 获取所有已点开格子的共享视图。第一次调用时 game server 会创建视图，并填入此前已经点开的格子
+RevealedBoard get_revealed_board(void);
+
 #endif	// __MINESWEEPER_HELPERS_H__
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "wrappers.h"
+#include "log.h"
+#include "plane.h"
+
+HugePageMode read_huge_page_mode() {
+	char* value = Getenv("MINESWEEPER_GS_HUGE_PAGES");
+	long mode = value ? atol(value) : HUGE_PAGES_OFF;
+	if (mode < HUGE_PAGES_OFF || mode > HUGE_PAGES_HUGETLB) {
+		app_error("MINESWEEPER_GS_HUGE_PAGES must be 0 (off), 1 (THP) or 2 (hugetlb).");
+	}
+	return (HugePageMode)mode;
+}
+
+// warn_once - Log a warning about huge pages, at most once for each `flag`
+static void warn_once(bool &flag, const char* what) {
+	if (!flag) {
+		flag = true;
+		log("Warning: %s (%s)\n", what, strerror(errno));
+	}
+}
+static bool warned_hugetlb, warned_thp, warned_mlock;
+
+// round_up_to_huge_page - The size of a plane of `size` bytes in huge page mode
+static long round_up_to_huge_page(long size) {
+	return (size + HUGE_PAGE_SIZE-1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// map_thp_plane - Map `size` (a multiple of HUGE_PAGE_SIZE) bytes aligned to
+// HUGE_PAGE_SIZE, so that every 2 MB of it can be a transparent huge page
+static char* map_thp_plane(long size) {
+	char* ptr = (char*)Mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	// Trim the unaligned head and the tail
+	long head = (HUGE_PAGE_SIZE - (unsigned long)ptr % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+	if (head) {
+		Munmap(ptr, head);
+	}
+	Munmap(ptr + head + size, HUGE_PAGE_SIZE - head);
+	ptr += head;
+	advise_huge_pages(ptr, size, HUGE_PAGES_THP);
+	return ptr;
+}
+
+// populate_plane - Fault in the pages of a plane now instead of at the first
+// access, and lock them if allowed
+static void populate_plane(char* ptr, long size) {
+	if (mlock(ptr, size) == 0) {
+		// `mlock` populates the pages, too
+		return;
+	}
+	warn_once(warned_mlock, "failed to lock a plane in memory, prefaulting it instead");
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+	for (long i = 0; i < size; i += HUGE_PAGE_SIZE) {
+		ptr[i] = 0;
+	}
+}
+
+void* alloc_plane(long size, HugePageMode mode) {
+	if (mode == HUGE_PAGES_OFF) {
+		return Mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	size = round_up_to_huge_page(size);
+	char* ptr = NULL;
+	if (mode == HUGE_PAGES_HUGETLB) {
+		ptr = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (ptr == MAP_FAILED) {
+			warn_once(warned_hugetlb, "failed to allocate a plane from the hugetlb pool, using THP instead");
+			ptr = NULL;
+		}
+	}
+	if (!ptr) {
+		ptr = map_thp_plane(size);
+	}
+	populate_plane(ptr, size);
+	return ptr;
+}
+
+void free_plane(void* ptr, long size, HugePageMode mode) {
+	Munmap(ptr, mode == HUGE_PAGES_OFF ? size : round_up_to_huge_page(size));
+}
+
+void advise_huge_pages(void* ptr, long size, HugePageMode mode) {
+	if (mode == HUGE_PAGES_OFF) return;
+	// `madvise` wants an aligned address. The unaligned head cannot be a huge
+	// page anyway
+	long head = (unsigned long)ptr % getpagesize();
+	if (madvise((char*)ptr - head, size + head, MADV_HUGEPAGE) < 0) {
+		warn_once(warned_thp, "madvise(MADV_HUGEPAGE) failed, using normal pages");
+	}
+}
@@ -0,0 +1,42 @@
+/*
+	plane.h - Allocating large bitmaps and tables ("planes") of the game server
+
+		Planes like `is_open` are as large as N*N/8 bytes (512 MB when
+	N = 65536), and a BFS touches them at random places, so with 4 KB pages
+	nearly every access misses the TLB. With MINESWEEPER_GS_HUGE_PAGES, planes
+	are backed by 2 MB pages:
+		- HUGE_PAGES_THP: transparent huge pages, asked for with
+		`madvise(MADV_HUGEPAGE)` on a 2 MB aligned mapping.
+		- HUGE_PAGES_HUGETLB: pages from the hugetlb pool (MAP_HUGETLB). If the
+		pool does not have enough pages, it falls back to HUGE_PAGES_THP.
+	In both modes a plane is populated when allocated, and locked in memory if
+	RLIMIT_MEMLOCK allows it. Every step is an optimization only: if the kernel
+	refuses it, we log it once and go on with what we have got.
+*/
+#ifndef __MINESWEEPER_PLANE_H__
+#define __MINESWEEPER_PLANE_H__
+
+enum HugePageMode {
+	HUGE_PAGES_OFF = 0,
+	HUGE_PAGES_THP = 1,
+	HUGE_PAGES_HUGETLB = 2,
+};
+
+constexpr long HUGE_PAGE_SIZE = 2L*1024*1024;
+
+// read_huge_page_mode - Parse MINESWEEPER_GS_HUGE_PAGES (default: HUGE_PAGES_OFF)
+HugePageMode read_huge_page_mode();
+
+// alloc_plane - Allocate `size` bytes of zeroed memory with `mode`
+void* alloc_plane(long size, HugePageMode mode);
+
+// free_plane - Free a plane allocated by `alloc_plane()` with the same `size`
+// and `mode`
+void free_plane(void* ptr, long size, HugePageMode mode);
+
+// advise_huge_pages - Ask for transparent huge pages for the existing mapping
+// at `ptr` (e.g. the map file, or the shm region). Nothing is done if `mode`
+// is HUGE_PAGES_OFF
+void advise_huge_pages(void* ptr, long size, HugePageMode mode);
+
+#endif	// __MINESWEEPER_PLANE_H__
@@ -1,12 +1,34 @@
+#include "wrappers.h"
 #include "queue.h"
 
+void Queue::init(long initial_capacity) {
+	capacity = min_capacity = initial_capacity;
+	int oldstate = Defer_cancel();
+	q = (int (*)[2])Malloc(capacity*sizeof(*q));
+	Restore_cancel(oldstate);
+	head = 0;
+	tail = -1;
+}
+
 void Queue::clear() {
+	if (capacity > min_capacity && (tail+1)*8 < capacity) {
+		capacity = min_capacity;
+		int oldstate = Defer_cancel();
+		q = (int (*)[2])Realloc(q, capacity*sizeof(*q));
+		Restore_cancel(oldstate);
+	}
 	head = 0;
 	tail = -1;
 }
 
 void Queue::push(int r, int c) {
 	tail += 1;
+	if (tail == capacity) {
+		capacity *= 2;
+		int oldstate = Defer_cancel();
+		q = (int (*)[2])Realloc(q, capacity*sizeof(*q));
+		Restore_cancel(oldstate);
+	}
 	q[tail][0] = r;
 	q[tail][1] = c;
 }
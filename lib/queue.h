@@ -1,5 +1,8 @@
 /*
 	queue.h - Queue for BFS
+
+		The queue grows when it is full, so there is no limit on the size of
+	the region to be expanded.
 */
 
 #ifndef __MINESWEEPER_QUEUE_H__
@@ -8,13 +11,18 @@
 #include "common.h"
 
 struct Queue {
-	int q[MAX_OPEN_GRID+16][2];
-	int head, tail;
+	int (*q)[2];
+	long capacity;
+	long min_capacity;	// The capacity after `init()`
+	long head, tail;
 
+	void init(long initial_capacity);
+	// Empty the queue. Like `VisitedSet::clear()`, it shrinks back to the
+	// initial capacity if less than 1/8 of it was used in the last use
 	void clear();
 	void push(int r, int c);
 	void pop(int &r, int &c);
 	bool empty();
 };
 
-#endif	// __MINESWEEPER_QUEUE_H__
\ No newline at end of file
+#endif	// __MINESWEEPER_QUEUE_H__
@@ -0,0 +1,106 @@
+#include <sys/un.h>
+#include "wrappers.h"
+#include "log.h"
+#include "session.h"
+
+// make_session_addr - Fill in the address of the socket at `path`
+static void make_session_addr(const char* path, struct sockaddr_un &addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		app_error("The path of the session socket is too long");
+	}
+	strcpy(addr.sun_path, path);
+}
+
+int listen_on_session_socket(const char* path) {
+	struct sockaddr_un addr;
+	make_session_addr(path, addr);
+	int sock = Socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	unlink(path);
+	Bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+	Listen(sock, LISTENQ);
+	return sock;
+}
+
+int connect_to_session_socket(const char* path) {
+	struct sockaddr_un addr;
+	make_session_addr(path, addr);
+	int sock = Socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	Connect(sock, (struct sockaddr*)&addr, sizeof(addr));
+	return sock;
+}
+
+void send_session_request(int sock, const SessionRequest &request, const int* fds) {
+	struct iovec iov = {(void*)&request, sizeof(request)};
+	char control[CMSG_SPACE(NUM_SESSION_FDS*sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(NUM_SESSION_FDS*sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, NUM_SESSION_FDS*sizeof(int));
+	if (sendmsg(sock, &msg, 0) != (ssize_t)sizeof(request)) {
+		unix_error("Failed to send the session to the game server daemon");
+	}
+}
+
+bool recv_session_request(int sock, SessionRequest &request, int* fds) {
+	struct iovec iov = {&request, sizeof(request)};
+	char control[CMSG_SPACE(NUM_SESSION_FDS*sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	// Collect the fds first, so that they are closed if anything is wrong
+	int num_fds = 0;
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		int n = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+		for (int i = 0; i < n; ++i) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+			if (num_fds < NUM_SESSION_FDS) {
+				fds[num_fds++] = fd;
+			} else {
+				close(fd);
+			}
+		}
+	}
+	bool ok = len == (ssize_t)sizeof(request) && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		&& num_fds == NUM_SESSION_FDS;
+	if (!ok) {
+		for (int i = 0; i < num_fds; ++i) {
+			close(fds[i]);
+		}
+		return false;
+	}
+	// Make sure the strings are terminated
+	request.shm_name[sizeof(request.shm_name)-1] = '\0';
+	request.map_file_path[sizeof(request.map_file_path)-1] = '\0';
+	request.core_pairs[sizeof(request.core_pairs)-1] = '\0';
+	return true;
+}
+
+void send_session_reply(int sock, const char* error) {
+	char buf[SESSION_ERROR_LEN] = {0};
+	strncpy(buf, error, SESSION_ERROR_LEN-1);
+	send(sock, buf, sizeof(buf), MSG_NOSIGNAL);
+}
+
+void recv_session_reply(int sock, char* error) {
+	ssize_t len = recv(sock, error, SESSION_ERROR_LEN, 0);
+	if (len <= 0) {
+		app_error("The game server daemon closed the connection without a reply");
+	}
+	error[SESSION_ERROR_LEN-1] = '\0';
+}
@@ -0,0 +1,60 @@
+/*
+	session.h - Handing judging sessions to a game server daemon
+
+		Normally the judger launches a game server for every judging session,
+	which loads the map again. A game server started with
+	MINESWEEPER_GS_DAEMON_SOCKET (see "Daemon mode" in game_server.cpp) loads
+	the map once, and listens on a unix socket at that path. A judger with the
+	same envariable connects to it instead of launching a game server, and
+	sends a `SessionRequest` along with the game server's ends of the pipes
+	(NUM_SESSION_FDS fds, in the order of `SessionFd`, passed with
+	SCM_RIGHTS). The daemon replies with an error message, which is empty if
+	the session is accepted.
+		The socket is a SOCK_SEQPACKET one, so a request (and the fds attached
+	to it) is always received as a whole.
+*/
+#ifndef __MINESWEEPER_SESSION_H__
+#define __MINESWEEPER_SESSION_H__
+
+#include <climits>
+#include "affinity.h"
+
+// The game server's ends of the pipes (see the comments in judger.cpp)
+enum SessionFd {
+	SESSION_FD_TO_PL,
+	SESSION_FD_FROM_PL,
+	SESSION_FD_TO_JU,
+	SESSION_FD_FROM_JU,
+	NUM_SESSION_FDS
+};
+
+struct SessionRequest {
+	char shm_name[64];
+	char map_file_path[PATH_MAX];	// Must be the map loaded by the daemon
+	char core_pairs[CORE_PAIRS_STR_LEN];	// MINESWEEPER_CORE_PAIRS of the judger, or ""
+};
+
+constexpr int SESSION_ERROR_LEN = 256;
+
+// listen_on_session_socket - Create the socket of a daemon at `path`, which
+// is replaced if it exists
+int listen_on_session_socket(const char* path);
+
+// connect_to_session_socket - Connect to the daemon listening at `path`
+int connect_to_session_socket(const char* path);
+
+// send_session_request - Send `request` and `fds` through `sock`
+void send_session_request(int sock, const SessionRequest &request, const int* fds);
+
+// recv_session_request - Receive a request and its fds from `sock`. Returns
+// false if the peer sent something else, in which case no fd is left open
+bool recv_session_request(int sock, SessionRequest &request, int* fds);
+
+// send_session_reply - Reply with `error`, "" for accepting the session
+// Errors are ignored, since the daemon should not die of a broken judger
+void send_session_reply(int sock, const char* error);
+
+// recv_session_reply - Receive the reply into `error` (SESSION_ERROR_LEN bytes)
+void recv_session_reply(int sock, char* error);
+
+#endif	// __MINESWEEPER_SESSION_H__
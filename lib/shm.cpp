@@ -6,18 +6,65 @@
 #include "log.h"
 #include "shm.h"
 
-char* open_shm(const char* shm_name) {
+char* open_shm(const char* shm_name, HugePageMode huge_page_mode) {
 	// Open the shm region
 	int mem_fd = Shm_open(shm_name, O_CREAT | O_RDWR, S_IRWXU);
 	// Mmap-ing
 	char* ptr = (char*)Mmap(NULL, TOTAL_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+	// Only effective if shmem THP is enabled (see
+	// /sys/kernel/mm/transparent_hugepage/shmem_enabled)
+	advise_huge_pages(ptr, TOTAL_SHM_SIZE, huge_page_mode);
+	return ptr;
+}
+
+unsigned char* map_shm_plane(const char* shm_name, long offset, long size, bool writable, HugePageMode huge_page_mode) {
+	int mem_fd = Shm_open(shm_name, writable ? O_RDWR : O_RDONLY, S_IRWXU);
+	if (writable) {
+		// Allocate the pages now, so that running out of space fails here
+		// instead of raising SIGBUS when it is written
+		int rc = posix_fallocate(mem_fd, offset, size);
+		if (rc) {
+			Close(mem_fd);
+			errno = rc;
+			return NULL;
+		}
+	}
+	int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+	unsigned char* ptr = (unsigned char*)Mmap(NULL, size, prot, MAP_SHARED, mem_fd, offset);
+	Close(mem_fd);
+	advise_huge_pages(ptr, size, huge_page_mode);
 	return ptr;
 }
 
 void init_shm_region(char* pos) {
-	SHM_PENDING_BIT(pos) = 0;
+	SHM_LAYOUT_VERSION(pos) = SHM_LAYOUT_VERSION_CURRENT;
+	SHM_REQUEST_SEQ(pos) = 0;
+	SHM_DONE_SEQ(pos) = 0;
 	SHM_SLEEPING_BIT(pos) = 0;
-	SHM_DONE_BIT(pos) = 0;
+	SHM_BATCH_SIZE(pos) = 0;
+	SHM_CLIENT_WAITING_BIT(pos) = 0;
+	SHM_CLOSE_STATE(pos) = 0;
+	SHM_NEW_ONLY_BIT(pos) = 0;
+	SHM_RUNS_BIT(pos) = 0;
+	SHM_RECT_H(pos) = 0;
+	SHM_RECT_W(pos) = 0;
+	SHM_CHUNK_READY(pos) = 0;
+	SHM_CHUNK_ACK(pos) = 0;
+	SHM_CHUNK_SLEEPING_BIT(pos) = 0;
+	SHM_CHUNK_WAITING_BIT(pos) = 0;
+	SHM_CHUNK_PARKED_BIT(pos) = 0;
+	SHM_CHUNK_MORE(pos, 0) = 0;
+}
+
+void init_async_shm_region(char* pos) {
+	SHM_LAYOUT_VERSION(pos) = SHM_LAYOUT_VERSION_CURRENT;
+	ASYNC_SQ_TAIL(pos) = 0;
+	ASYNC_SLEEPING_BIT(pos) = 0;
+	ASYNC_CQ_TAIL(pos) = 0;
+	ASYNC_ARENA_RELEASED(pos) = 0;
+	ASYNC_CLIENT_WAITING_BIT(pos) = 0;
+	ASYNC_ARENA_SLEEPING_BIT(pos) = 0;
+	SHM_CLOSE_STATE(pos) = 0;
 }
 
 void generate_random_shm_name(char* result) {
@@ -4,35 +4,276 @@
 #ifndef __MINESWEEPER_SHM_H__
 #define __MINESWEEPER_SHM_H__
 
+#include "plane.h"
+
 // The maximum number of channels the player's program can have
 #define MAX_CHANNEL 1024
 
 // The size of each shared memory region held by a channel, in bytes
 #define CHANNEL_SHM_SIZE (256*1024)	// 256 KB
 
+// The size of the global region, which is right after the regions of all channels
+#define GLOBAL_SHM_SIZE 4096
+
 // The size of the shm region
-#define TOTAL_SHM_SIZE (MAX_CHANNEL*CHANNEL_SHM_SIZE)
-
-// Macros for accessing members inside a shm region
-#define SHM_PENDING_BIT(pos) (*((volatile unsigned int*)(pos)))
-#define SHM_PENDING_BIT_PTR(pos) ((unsigned int*)(pos))
-#define SHM_SLEEPING_BIT(pos) (*((volatile unsigned int*)(pos+4)))
-#define SHM_SLEEPING_BIT_PTR(pos) (((unsigned int*)(pos+4)))
-#define SHM_DONE_BIT(pos) (*((volatile unsigned int*)(pos+8)))
-#define SHM_SKIP_WHEN_REOPEN_BIT(pos) (*((volatile unsigned int*)(pos+12)))
-#define SHM_DO_NOT_EXPAND_BIT(pos) (*((volatile unsigned int*)(pos+16)))
-#define SHM_CLICK_R(pos) (*((volatile unsigned short*)(pos+20)))
-#define SHM_CLICK_C(pos) (*((volatile unsigned short*)(pos+22)))
-#define SHM_OPENED_GRID_COUNT(pos) (*((volatile int*)(pos+24)))
-#define SHM_OPENED_GRID_ARR(pos) ((unsigned short (*)[16384][3])(pos+28))
+#define TOTAL_SHM_SIZE (MAX_CHANNEL*CHANNEL_SHM_SIZE + GLOBAL_SHM_SIZE)
+
+// The maximum number of clicks in a batched request
+#define MAX_BATCH_SIZE 64
+
+// Flags for each click in a batched request or an asynchronous channel
+#define SHM_CLICK_FLAG_SKIP_WHEN_REOPEN 0x1
+#define SHM_CLICK_FLAG_DO_NOT_EXPAND 0x2
+#define SHM_CLICK_FLAG_NEW_ONLY 0x4
+#define SHM_CLICK_FLAG_RUNS 0x8
+
+/*
+	Run-length replies (SHM_CLICK_FLAG_RUNS)
+	Normally every opened grid takes an entry of 3 unsigned shorts (r, c and
+	the number) in the reply. With SHM_CLICK_FLAG_RUNS, grids are put into runs
+	of consecutive grids in the same row instead. A run is a header entry
+	(r, c of its first grid, length), followed by ceil(length /
+	SHM_RUN_GRIDS_PER_ENTRY) entries holding the numbers of its grids, 4 bits
+	each, the i-th grid in the low (even i) or high (odd i) half of the
+	(i/2)-th byte. A run never crosses chunks, and "the number of grids" in
+	the reply (SHM_OPENED_GRID_COUNT, chunk and batch counts, and the count of
+	an asynchronous completion) counts entries, so the buffers and the arena
+	are managed in the same way in both formats.
+*/
+#define SHM_RUN_GRIDS_PER_ENTRY 12
+#define SHM_MAX_RUN_LENGTH 65535
+
+/*
+	Layout of a channel (see "Memory layout of a channel" in game_server.cpp)
+	Fields written by the player's program and fields written by the game
+	server are in different cache lines, so a click only moves the request line
+	to the game server and the completion line back. Requests and completions
+	are numbered: the player's program increases SHM_REQUEST_SEQ to submit a
+	request, and the game server sets SHM_DONE_SEQ to the same number when it is
+	done, so nobody needs to clear a bit afterwards.
+	The sequence numbers and the bits used for sleeping (SHM_CLIENT_WAITING_BIT,
+	SHM_SLEEPING_BIT) are accessed with `__atomic` builtins only: a store
+	publishing a request or a completion is a release (the data written
+	before it becomes visible with it), and the pair "store my word, then load
+	the other side's sleeping bit" is SEQ_CST on both sides, so a wake-up is
+	never lost and never repeated.
+	The first line holds the version of the layout, which is checked by the
+	player's program when it creates a channel, so a helper library built for
+	another layout fails loudly instead of misreading the shm.
+*/
+#define SHM_LAYOUT_VERSION_CURRENT 9
+#define SHM_LAYOUT_VERSION(pos) (*((volatile unsigned int*)(pos)))
+// The request line. Written by the player's program
+#define SHM_REQUEST_SEQ(pos) (*((unsigned int*)(pos+64)))
+#define SHM_REQUEST_SEQ_PTR(pos) ((unsigned int*)(pos+64))
+#define SHM_SKIP_WHEN_REOPEN_BIT(pos) (*((volatile unsigned int*)(pos+68)))
+#define SHM_DO_NOT_EXPAND_BIT(pos) (*((volatile unsigned int*)(pos+72)))
+#define SHM_CLICK_R(pos) (*((volatile unsigned short*)(pos+76)))
+#define SHM_CLICK_C(pos) (*((volatile unsigned short*)(pos+78)))
+#define SHM_BATCH_SIZE(pos) (*((volatile int*)(pos+80)))
+// Whether the player's program is sleeping on SHM_DONE_SEQ (see `submit_and_wait()`
+// in minesweeper_helpers.cpp). The game server only wakes it up when it is 1
+#define SHM_CLIENT_WAITING_BIT(pos) (*((unsigned int*)(pos+88)))
+// SHM_CLOSE_REQUESTED if the request closes the channel (see `Channel::close()`)
+// instead of clicking. After the request is completed, the player's program
+// sets it to SHM_CLOSE_LEFT when it no longer touches the shm region, and then
+// the game server may reuse the region
+#define SHM_CLOSE_STATE(pos) (*((unsigned int*)(pos+92)))
+#define SHM_CLOSE_REQUESTED 1
+#define SHM_CLOSE_LEFT 2
+// Only return the grids opened for the first time (SHM_CLICK_FLAG_NEW_ONLY)
+#define SHM_NEW_ONLY_BIT(pos) (*((volatile unsigned int*)(pos+96)))
+// Put the result into runs (SHM_CLICK_FLAG_RUNS)
+#define SHM_RUNS_BIT(pos) (*((volatile unsigned int*)(pos+100)))
+// The height and the width of the rectangle to open (see "Rectangle requests"
+// below). 0 for a single click
+#define SHM_RECT_H(pos) (*((volatile int*)(pos+104)))
+#define SHM_RECT_W(pos) (*((volatile int*)(pos+108)))
+// The completion line. Written by the game server
+#define SHM_DONE_SEQ(pos) (*((unsigned int*)(pos+128)))
+#define SHM_DONE_SEQ_PTR(pos) ((unsigned int*)(pos+128))
+#define SHM_OPENED_GRID_COUNT(pos) (*((volatile int*)(pos+132)))
+#define SHM_SLEEPING_BIT(pos) (*((unsigned int*)(pos+136)))
+// The counts of a rectangle request
+#define SHM_RECT_NUM_MINES(pos) (*((volatile int*)(pos+164)))
+#define SHM_RECT_NUM_NEW(pos) (*((volatile int*)(pos+168)))
+// Arrays
+#define SHM_OPENED_GRID_ARR(pos) ((unsigned short (*)[16384][3])(pos+256))
+#define SHM_BATCH_REQUEST_ARR(pos) ((unsigned short (*)[MAX_BATCH_SIZE][3])(pos+98560))
+#define SHM_BATCH_RESULT_ARR(pos) ((int (*)[MAX_BATCH_SIZE][2])(pos+98944))
+
+/*
+	Rectangle requests (see `Channel::click_rect()`)
+	With SHM_RECT_H > 0, the request opens every grid of the rectangle of
+	SHM_RECT_H rows and SHM_RECT_W columns at (SHM_CLICK_R, SHM_CLICK_C),
+	without expansion. At most SHM_MAX_RECT_GRIDS grids are allowed. The reply
+	is a tile put into SHM_OPENED_GRID_ARR, 4 bits per grid in row-major order
+	(the grid (r+i, c+j) has the index i*w+j, and lives in the low (even index)
+	or high (odd index) half of the (index/2)-th byte): the number in it, or
+	SHM_RECT_CODE_MINE. SHM_OPENED_GRID_COUNT is the number of grids, and
+	SHM_RECT_NUM_MINES / SHM_RECT_NUM_NEW count the mines in the rectangle and
+	the grids opened for the first time (including mines).
+*/
+#define SHM_MAX_RECT_GRIDS 65536
+#define SHM_RECT_CODE_MINE 0xf
+
+/*
+	Streaming of large results (see `Channel::next_chunk()`)
+	A reply holds at most MAX_OPEN_GRID grids. If a click opens more grids, the
+	reply is split into chunks. The k-th chunk is put into SHM_CHUNK_ARR(pos, k),
+	which is SHM_OPENED_GRID_ARR for even k and a second buffer for odd k, so the
+	game server fills one buffer while the player's program reads the other.
+	The 0-th chunk is delivered as a normal reply (through SHM_DONE_SEQ). Later
+	chunks are published by increasing SHM_CHUNK_READY. The player's program
+	increases SHM_CHUNK_ACK when it no longer uses a chunk, and the game server
+	waits for it (spinning first, then sleeping on it with `futex_wait`) before
+	reusing a buffer. The player's program waits for SHM_CHUNK_READY in the
+	same way.
+	A thread in the pool does not wait for SHM_CHUNK_ACK. It keeps the chunks it
+	cannot publish yet, sets SHM_CHUNK_PARKED_BIT and moves on to other
+	channels. The player's program takes the bit back (with an atomic exchange)
+	after increasing SHM_CHUNK_ACK, and rings the doorbell, so that a thread in
+	the pool publishes the kept chunks. It keeps a limited number of chunks per
+	channel, and beyond that it waits for SHM_CHUNK_ACK like other threads (see
+	"Parked replies" in game_server.cpp).
+*/
+// The number of published chunks of the current reply. Written by the game server
+#define SHM_CHUNK_READY(pos) (*((volatile unsigned int*)(pos+140)))
+// The number of chunks consumed by the player's program
+#define SHM_CHUNK_ACK(pos) (*((volatile unsigned int*)(pos+84)))
+#define SHM_CHUNK_ACK_PTR(pos) ((unsigned int*)(pos+84))
+// Whether the game server is sleeping on SHM_CHUNK_ACK
+#define SHM_CHUNK_SLEEPING_BIT(pos) (*((volatile unsigned int*)(pos+144)))
+// Whether the player's program is sleeping on SHM_CHUNK_READY
+#define SHM_CHUNK_WAITING_BIT(pos) (*((unsigned int*)(pos+112)))
+#define SHM_CHUNK_READY_PTR(pos) ((unsigned int*)(pos+140))
+// Whether the reply is parked by the thread pool, waiting for SHM_CHUNK_ACK
+#define SHM_CHUNK_PARKED_BIT(pos) (*((unsigned int*)(pos+172)))
+// The number of grids in the k-th chunk (for k = 0, SHM_OPENED_GRID_COUNT or
+// the batch result is used instead), and whether there are more chunks after it
+#define SHM_CHUNK_COUNT(pos, k) (*((volatile int*)(pos+148+(k)%2*8)))
+#define SHM_CHUNK_MORE(pos, k) (*((volatile int*)(pos+152+(k)%2*8)))
+#define SHM_CHUNK_ARR(pos, k) ((k)%2 ? (unsigned short (*)[16384][3])(pos+131072) : SHM_OPENED_GRID_ARR(pos))
+
+/*
+	Layout of an asynchronous channel (see `AsyncChannel` in minesweeper_helpers.h)
+	It has a submission ring (written by the player's program) and a completion
+	ring (written by the game server), each of which has ASYNC_RING_SIZE entries.
+	The opened grids are put into an "arena" of ASYNC_ARENA_SIZE grids, which is
+	used as a ring buffer, too.
+	A click opening more than MAX_OPEN_GRID grids gets several completions
+	(chunks, see above) with the same tag, all but the last of which have
+	ASYNC_COMPLETION_FLAG_MORE. Such a chunk holds MAX_OPEN_GRID grids of the
+	arena, so at most ASYNC_ARENA_SIZE/MAX_OPEN_GRID of them are in the
+	completion ring at the same time, besides one completion for each click in
+	flight. That's why the completion ring is larger than the submission ring.
+*/
+#define ASYNC_RING_SIZE 64
+#define ASYNC_CQ_RING_SIZE 128
+#define ASYNC_ARENA_SIZE 32768
+#define ASYNC_COMPLETION_FLAG_MORE 0x1
+// The grids of the completion are in runs (the click has SHM_CLICK_FLAG_RUNS)
+#define ASYNC_COMPLETION_FLAG_RUNS 0x2
+// A submission with this flag closes the channel (see `AsyncChannel::close()`).
+// Its completion is the last one
+#define ASYNC_SUBMISSION_FLAG_CLOSE 0x8000
+
+struct AsyncSubmission {
+	unsigned int tag;	// Copied to the corresponding completion as is
+	unsigned short r, c, flags;
+};
+struct AsyncCompletion {
+	unsigned int tag;
+	int count;	// Same as SHM_OPENED_GRID_COUNT
+	unsigned long arena_pos;	// Opened grids are at ASYNC_ARENA(pos)[arena_pos%ASYNC_ARENA_SIZE]
+	unsigned int flags;	// ASYNC_COMPLETION_FLAG_*
+};
+
+// The first line holds the version of the layout, same as SHM_LAYOUT_VERSION
+// Number of submitted requests. Written by the player's program
+#define ASYNC_SQ_TAIL(pos) (*((unsigned int*)(pos+64)))
+// Grids before this position (in the arena) are no longer used by the player's program
+#define ASYNC_ARENA_RELEASED(pos) (*((unsigned long*)(pos+72)))
+// The low 32 bits of ASYNC_ARENA_RELEASED, on which the worker thread sleeps
+#define ASYNC_ARENA_RELEASED_PTR(pos) ((unsigned int*)(pos+72))
+// Whether the player's program is sleeping (waiting on ASYNC_CQ_TAIL). Written by the player's program
+#define ASYNC_CLIENT_WAITING_BIT(pos) (*((unsigned int*)(pos+80)))
+// SHM_CLOSE_STATE is at the same offset, but only SHM_CLOSE_LEFT is used
+// (the closing request is a submission with ASYNC_SUBMISSION_FLAG_CLOSE)
+// Number of completed requests. Written by the game server
+#define ASYNC_CQ_TAIL(pos) (*((unsigned int*)(pos+128)))
+// Whether the worker thread is sleeping (waiting on ASYNC_SQ_TAIL). Written by the game server
+#define ASYNC_SLEEPING_BIT(pos) (*((unsigned int*)(pos+132)))
+// Whether the worker thread is sleeping (waiting on ASYNC_ARENA_RELEASED_PTR). Written by the game server
+#define ASYNC_ARENA_SLEEPING_BIT(pos) (*((unsigned int*)(pos+136)))
+#define ASYNC_SQ_ARR(pos) ((AsyncSubmission*)(pos+256))
+#define ASYNC_CQ_ARR(pos) ((AsyncCompletion*)(pos+1024))
+#define ASYNC_ARENA(pos) ((unsigned short (*)[3])(pos+4096))
+
+/*
+	Layout of the global region
+	It is used when the game server serves channels with a thread pool (see
+	"Thread pool" in game_server.cpp). Instead of waking up the worker thread of
+	the channel, the player's program sets the bit of the channel in the
+	doorbell bitmap, and wakes up a thread in the pool if any of them is
+	sleeping. It also carries the core pair of a new channel (see `affinity.h`).
+*/
+#define GLOBAL_SHM_POS(shm_start) ((shm_start) + MAX_CHANNEL*CHANNEL_SHM_SIZE)
+// Whether the thread pool is used. Written by the game server before it sends N and K
+#define SHM_POOL_MODE(gpos) (*((volatile unsigned int*)(gpos)))
+// The i-th bit is set if the channel with ID i has a pending request
+#define SHM_POOL_DOORBELL(gpos) ((unsigned long*)(gpos+64))
+// The number of threads in the pool that are going to sleep or sleeping
+#define SHM_POOL_SLEEPERS(gpos) (*((unsigned int*)(gpos+256)))
+// Sleeping threads wait on it. It is increased before waking them up
+#define SHM_POOL_SEQ(gpos) (*((unsigned int*)(gpos+320)))
+// The index of the core pair (in MINESWEEPER_CORE_PAIRS) of the player's thread
+// creating a channel, or -1 if it is not bound. Written by the player's program
+// right before it sends 'C' or 'A'
+#define SHM_CREATE_CORE_PAIR(gpos) (*((int*)(gpos+384)))
+
+/*
+	Planes after the channels
+	The game server extends the shm object with planes of N*N grids, which it
+	writes and the player's program maps read-only. A grid with index
+	i = r*N+c is located like in `is_open` / `adj_mine_table`.
+	- The open bitmap (on request, 'B', or at start-up with
+	MINESWEEPER_GS_OPEN_BITMAP): bit i%8 of byte i/8 is 1 if the grid is a
+	non-mine grid opened by anyone. The player's program answers
+	`click(r, c, true)` on such grids without asking the game server (see
+	"Shared open bitmap" in game_server.cpp). Opened mines are not in it, so
+	the player's program does not need to know where the mines are.
+	- The revealed board (on request, 'R', see "Revealed board" in
+	game_server.cpp): 4 bits per grid, the (i%2*4)-th ~ (i%2*4+3)-th bits of
+	byte i/2. Grids only ever go from REVEALED_CODE_UNKNOWN to another code.
+	Each plane starts at a multiple of HUGE_PAGE_SIZE after TOTAL_SHM_SIZE.
+*/
+#define SHM_PLANE_ROUND_UP(x) (((x) + HUGE_PAGE_SIZE-1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE)
+#define OPEN_BITMAP_OFFSET SHM_PLANE_ROUND_UP(TOTAL_SHM_SIZE)
+#define OPEN_BITMAP_SIZE(N) ((N)*(N)/8)
+#define REVEALED_PLANE_OFFSET(N) (OPEN_BITMAP_OFFSET + SHM_PLANE_ROUND_UP(OPEN_BITMAP_SIZE(N)))
+#define REVEALED_PLANE_SIZE(N) ((N)*(N)/2)
+#define REVEALED_CODE_UNKNOWN 0	// Not opened yet
+#define REVEALED_CODE_MINE 0xf	// An opened mine
+#define REVEALED_CODE_NUMBER(x) ((x)+1)	// An opened grid with number x
 
 // Open the shared memory (shm), and return a pointer pointing to its head
-char* open_shm(const char* shm_name);
+// With `huge_page_mode`, the mapping is advised to use huge pages
+char* open_shm(const char* shm_name, HugePageMode huge_page_mode);
+
+// Map the plane of `size` bytes at `offset` in the shm object `shm_name`.
+// The game server creates it (`writable`), which fails and returns NULL (with
+// errno set) if there is no space for it. The player's program maps it read-only
+unsigned char* map_shm_plane(const char* shm_name, long offset, long size, bool writable, HugePageMode huge_page_mode);
 
 // Initialize a shm region
 // This is supposed to be called by the game server
 void init_shm_region(char* pos);
 
+// Initialize a shm region for an asynchronous channel
+// This is supposed to be called by the game server
+void init_async_shm_region(char* pos);
+
 // Generate a random shm name
 // Looks like `/minesweeper_shm_12556206635472641212`
 void generate_random_shm_name(char* result);
@@ -0,0 +1,83 @@
+#include "wrappers.h"
+#include "visited_set.h"
+
+void VisitedSet::init(long initial_capacity) {
+	capacity = 1;
+	while (capacity < initial_capacity) capacity *= 2;
+	min_capacity = capacity;
+	int oldstate = Defer_cancel();
+	slots = (Slot*)Calloc(capacity, sizeof(Slot));
+	Restore_cancel(oldstate);
+	size = 0;
+	epoch = 1;
+}
+
+void VisitedSet::clear() {
+	if (capacity > min_capacity && size*8 < capacity) {
+		shrink();
+		return;
+	}
+	size = 0;
+	epoch += 1;
+	if (epoch == 0) {
+		// The epoch wraps around, so stale stamps may look valid again
+		memset(slots, 0, capacity*sizeof(Slot));
+		epoch = 1;
+	}
+}
+
+// find_slot - Return the slot containing `key`, or the empty slot where
+// `key` should be put
+long VisitedSet::find_slot(long key) {
+	long mask = capacity-1;
+	long pos = (unsigned long)key*0x9E3779B97F4A7C15ul >> 32 & mask;
+	while (slots[pos].epoch == epoch && slots[pos].key != key) {
+		pos = (pos+1) & mask;
+	}
+	return pos;
+}
+
+void VisitedSet::grow() {
+	Slot* old_slots = slots;
+	long old_capacity = capacity;
+	capacity *= 2;
+	int oldstate = Defer_cancel();
+	slots = (Slot*)Calloc(capacity, sizeof(Slot));
+	for (long i = 0; i < old_capacity; ++i) {
+		if (old_slots[i].epoch == epoch) {
+			slots[find_slot(old_slots[i].key)] = old_slots[i];
+		}
+	}
+	Free(old_slots);
+	Restore_cancel(oldstate);
+}
+
+// shrink - Empty the set, and go back to the initial capacity
+void VisitedSet::shrink() {
+	int oldstate = Defer_cancel();
+	Free(slots);
+	capacity = min_capacity;
+	slots = (Slot*)Calloc(capacity, sizeof(Slot));
+	Restore_cancel(oldstate);
+	size = 0;
+	epoch = 1;
+}
+
+bool VisitedSet::insert(long key) {
+	// Keep the load factor below 1/2
+	if ((size+1)*2 > capacity) {
+		grow();
+	}
+	long pos = find_slot(key);
+	if (slots[pos].epoch == epoch) {
+		return false;
+	}
+	slots[pos].key = key;
+	slots[pos].epoch = epoch;
+	size += 1;
+	return true;
+}
+
+bool VisitedSet::contains(long key) {
+	return slots[find_slot(key)].epoch == epoch;
+}
@@ -0,0 +1,39 @@
+/*
+	visited_set.h - A set of grid indexes, used for marking visited grids in BFS
+
+		It is an open-addressing hash set (with linear probing), so its size is
+	proportional to the number of grids in it, instead of N*N. Every slot
+	carries an "epoch" stamp, and a slot is in use only if its stamp equals
+	the current epoch, so `clear()` is O(1).
+*/
+
+#ifndef __MINESWEEPER_VISITED_SET_H__
+#define __MINESWEEPER_VISITED_SET_H__
+
+struct VisitedSet {
+	struct Slot {
+		long key;
+		unsigned int epoch;
+	};
+	Slot* slots;
+	long capacity;	// Always a power of 2
+	long min_capacity;	// The capacity after `init()`
+	long size;
+	unsigned int epoch;
+
+	void init(long initial_capacity);
+	// Empty the set. It also shrinks back to the initial capacity if it was
+	// mostly empty (less than 1/8 of the slots) in the last use, so one huge
+	// expansion does not keep its memory for the rest of the run
+	void clear();
+	// Insert `key` into the set. Return true if it was not in the set before
+	bool insert(long key);
+	bool contains(long key);
+
+private:
+	long find_slot(long key);
+	void grow();
+	void shrink();
+};
+
+#endif	// __MINESWEEPER_VISITED_SET_H__
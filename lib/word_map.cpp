@@ -0,0 +1,91 @@
+#include "wrappers.h"
+#include "word_map.h"
+
+void WordMap::init(long initial_capacity) {
+	capacity = 1;
+	while (capacity < initial_capacity) capacity *= 2;
+	min_capacity = capacity;
+	int oldstate = Defer_cancel();
+	slots = (Slot*)Calloc(capacity, sizeof(Slot));
+	Restore_cancel(oldstate);
+	size = 0;
+	epoch = 1;
+}
+
+void WordMap::clear() {
+	if (capacity > min_capacity && size*8 < capacity) {
+		shrink();
+		return;
+	}
+	size = 0;
+	epoch += 1;
+	if (epoch == 0) {
+		// The epoch wraps around, so stale stamps may look valid again
+		memset(slots, 0, capacity*sizeof(Slot));
+		epoch = 1;
+	}
+}
+
+// find_slot - Return the slot containing `key`, or the empty slot where
+// `key` should be put
+long WordMap::find_slot(long key) {
+	long mask = capacity-1;
+	long pos = (unsigned long)key*0x9E3779B97F4A7C15ul >> 32 & mask;
+	while (slots[pos].epoch == epoch && slots[pos].key != key) {
+		pos = (pos+1) & mask;
+	}
+	return pos;
+}
+
+void WordMap::grow() {
+	Slot* old_slots = slots;
+	long old_capacity = capacity;
+	capacity *= 2;
+	int oldstate = Defer_cancel();
+	slots = (Slot*)Calloc(capacity, sizeof(Slot));
+	for (long i = 0; i < old_capacity; ++i) {
+		if (old_slots[i].epoch == epoch) {
+			slots[find_slot(old_slots[i].key)] = old_slots[i];
+		}
+	}
+	Free(old_slots);
+	Restore_cancel(oldstate);
+}
+
+// shrink - Empty the map, and go back to the initial capacity
+void WordMap::shrink() {
+	int oldstate = Defer_cancel();
+	Free(slots);
+	capacity = min_capacity;
+	slots = (Slot*)Calloc(capacity, sizeof(Slot));
+	Restore_cancel(oldstate);
+	size = 0;
+	epoch = 1;
+}
+
+uint64_t WordMap::test_word(long key) {
+	long pos = find_slot(key);
+	return slots[pos].epoch == epoch ? slots[pos].word : 0;
+}
+
+uint64_t WordMap::set_word(long key, uint64_t bits) {
+	long pos = find_slot(key);
+	if (slots[pos].epoch == epoch) {
+		uint64_t old = slots[pos].word;
+		slots[pos].word = old | bits;
+		return old;
+	}
+	if (!bits) {
+		return 0;
+	}
+	// Keep the load factor below 1/2
+	if ((size+1)*2 > capacity) {
+		grow();
+		pos = find_slot(key);
+	}
+	slots[pos].key = key;
+	slots[pos].epoch = epoch;
+	slots[pos].word = bits;
+	size += 1;
+	return 0;
+}
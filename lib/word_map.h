@@ -0,0 +1,43 @@
+/*
+	word_map.h - A map from word indexes to 64-bit words of grids, used by the
+	bit-parallel flood fill in the game server
+
+		Like `VisitedSet`, it is an open-addressing hash map (with linear
+	probing) whose slots carry an "epoch" stamp, so `clear()` is O(1). It is
+	a separate type so that the slots of `VisitedSet`, which only needs keys,
+	do not pay for the word.
+*/
+
+#ifndef __MINESWEEPER_WORD_MAP_H__
+#define __MINESWEEPER_WORD_MAP_H__
+
+#include <cstdint>
+
+struct WordMap {
+	struct Slot {
+		long key;
+		unsigned int epoch;
+		uint64_t word;
+	};
+	Slot* slots;
+	long capacity;	// Always a power of 2
+	long min_capacity;	// The capacity after `init()`
+	long size;
+	unsigned int epoch;
+
+	void init(long initial_capacity);
+	// Empty the map. It shrinks like `VisitedSet::clear()`
+	void clear();
+	// The word of `key`, or 0 if `key` is not in the map
+	uint64_t test_word(long key);
+	// Set `bits` in the word of `key`, inserting `key` if it is not in the map
+	// (unless `bits` is 0). Return the word before
+	uint64_t set_word(long key, uint64_t bits);
+
+private:
+	long find_slot(long key);
+	void grow();
+	void shrink();
+};
+
+#endif	// __MINESWEEPER_WORD_MAP_H__
@@ -84,4 +84,54 @@ void Pthread_setcanceltype(int type, int* oldtype) {
 	if ((rc = pthread_setcanceltype(type, oldtype)) < 0) {
 		posix_error(rc, "pthread_setcanceltype error");
 	}
-}
\ No newline at end of file
+}
+
+int Defer_cancel() {
+	int oldstate;
+	Pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	return oldstate;
+}
+
+void Restore_cancel(int oldstate) {
+	Pthread_setcancelstate(oldstate, NULL);
+}
+
+int Epoll_create1(int flags) {
+	int rc;
+	if ((rc = epoll_create1(flags)) < 0) {
+		unix_error("epoll_create1 error");
+	}
+	return rc;
+}
+
+void Epoll_add(int epfd, int fd, uint32_t events) {
+	struct epoll_event event;
+	event.events = events;
+	event.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		unix_error("epoll_ctl error");
+	}
+}
+
+void Epoll_del(int epfd, int fd) {
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+		unix_error("epoll_ctl error");
+	}
+}
+
+int Epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+	int rc;
+	if ((rc = epoll_wait(epfd, events, maxevents, timeout)) < 0) {
+		if (errno == EINTR) return 0;
+		unix_error("epoll_wait error");
+	}
+	return rc;
+}
+
+int Signalfd(const sigset_t* mask, int flags) {
+	int rc;
+	if ((rc = signalfd(-1, mask, flags)) < 0) {
+		unix_error("signalfd error");
+	}
+	return rc;
+}
@@ -9,6 +9,8 @@
 
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include "csapp.h" // include all wrapper functions from csapp.h
 
 /* Create a one-way communication channel (pipe).
@@ -62,4 +64,29 @@ void Pthread_setcancelstate(int state, int* oldstate);
    type in *OLDTYPE if OLDTYPE is not NULL.  */
 void Pthread_setcanceltype(int type, int* oldtype);
 
+/* Defer the cancellation of the calling thread, returning the old state
+   for `Restore_cancel()`. Threads which are cancelled asynchronously call
+   it around code which is not async-cancel-safe, e.g. malloc().  */
+int Defer_cancel();
+
+/* Restore the cancelability state saved by `Defer_cancel()`. A cancellation
+   requested in between is acted upon here.  */
+void Restore_cancel(int oldstate);
+
+/* Create an epoll instance. Returns fd for the new instance. */
+int Epoll_create1(int flags);
+
+/* Add `fd` to the interest list of EPFD, reporting EVENTS with `fd` as data.  */
+void Epoll_add(int epfd, int fd, uint32_t events);
+
+/* Remove `fd` from the interest list of EPFD.  */
+void Epoll_del(int epfd, int fd);
+
+/* Wait for events on EPFD. Returns the number of events in EVENTS, which is
+   0 if interrupted by a signal.  */
+int Epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout);
+
+/* Create an fd for accepting the signals in MASK, which should be blocked.  */
+int Signalfd(const sigset_t* mask, int flags);
+
 #endif	// __MINESWEEPER_WRAPPERS_H__
\ No newline at end of file